@@ -1,6 +1,12 @@
 #include <sstream>
 #include <fstream>
-#include <stack>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <iomanip>
+#include <cmath>
 #include <boost/lexical_cast.hpp>
 #include <boost/property_tree/xml_parser.hpp>
 #define timer timer_for_boost_progress_t
@@ -8,6 +14,8 @@
 #undef timer
 #include <boost/timer/timer.hpp>
 #include "argos.h"
+#include "array.h"
+#include "parallel.h"
 #include "ccolor.h"
 
 namespace argos {
@@ -20,16 +28,145 @@ namespace argos {
         boost::property_tree::read_xml(path, *config);
     }
 
-    static char const *METHOD_NAMES[] = {"NONE", "PREDICT", "PREUPDATE", "UPDATE"};
+    static char const *METHOD_NAMES[] = {"NONE", "PREDICT", "PREUPDATE", "UPDATE", "USER"};
+
+    // Nodes may number their own methods from TASK_USER on.
+    static char const *methodName (Method method) {
+        return METHOD_NAMES[std::min<unsigned>(method, TASK_USER)];
+    }
 
     ostream &operator << (ostream &os, Plan::TaskId const &task) {
         Node const *node = task.first;
         Method method = task.second;
-        os << node->name() << ':' << node->type() << ":" << METHOD_NAMES[method];
+        os << node->name() << ':' << node->type() << ":" << methodName(method);
         return os;
     }
 
-    Plan::Plan (Model const &model): frozen(false) {
+    /// Worker pool for parallel plan execution.
+    /**
+     * Dependencies are tracked with the same n_left/outputs counters as
+     * the sequential scheduler, protected by a single mutex.  The thread
+     * calling Plan::run participates as a worker.  If a task throws, no
+     * further tasks are dispatched and the exception is re-thrown by run
+     * once the running tasks have finished.  Each worker limits the
+     * OpenMP teams (and OpenMP BLAS) it starts to its share of the
+     * threads, so concurrent tasks don't oversubscribe the cores.
+     */
+    struct Plan::Scheduler {
+        Plan const *plan;
+        int share;                      // OpenMP threads per worker
+        vector<std::thread> workers;
+        std::mutex lock;
+        std::condition_variable work;    // signaled when tasks become ready or a run ends
+        vector<unsigned> n_left;
+        deque<unsigned> ready;
+        unsigned finished;
+        unsigned running;
+        std::exception_ptr error;
+        bool stop;
+
+        Scheduler (Plan const *p, unsigned threads)
+            : plan(p), share(std::max(1, parallel::max() / int(threads))),
+            n_left(p->tasks.size()), finished(0), running(0), stop(false) {
+            for (unsigned i = 1; i < threads; ++i) {
+                workers.push_back(std::thread([this, i]() {
+                    parallel::limit(share);
+                    std::unique_lock<std::mutex> lk(lock);
+                    for (;;) {
+                        work.wait(lk, [this]() { return stop || !ready.empty(); });
+                        if (stop) break;
+                        execute(lk, i);
+                    }
+                }));
+            }
+        }
+
+        ~Scheduler () {
+            {
+                std::unique_lock<std::mutex> lk(lock);
+                stop = true;
+            }
+            work.notify_all();
+            for (auto &w: workers) {
+                w.join();
+            }
+        }
+
+        // Pop one ready task and run it on worker tid, lock must be held.
+        void execute (std::unique_lock<std::mutex> &lk, unsigned tid) {
+            unsigned idx = ready.front();
+            ready.pop_front();
+            ++running;
+            lk.unlock();
+            Task const &task = plan->tasks[idx];
+            LOG(debug) << "RUN " << task.id;
+            std::exception_ptr e;
+            try {
+                if (plan->profiler) {
+                    Profiler::Clock::time_point begin = Profiler::Clock::now();
+                    task.callback(task.context);
+                    plan->profiler->record(task.id, begin, Profiler::Clock::now(), tid);
+                }
+                else {
+                    task.callback(task.context);
+                }
+            }
+            catch (...) {
+                e = std::current_exception();
+            }
+            lk.lock();
+            --running;
+            if (e) {
+                if (!error) error = e;
+                ready.clear();
+            }
+            else if (!error) {
+                unsigned n = 0;
+                for (unsigned o: task.outputs) {
+                    BOOST_VERIFY(n_left[o] > 0);
+                    --n_left[o];
+                    if (n_left[o] == 0) {
+                        ready.push_back(o);
+                        ++n;
+                    }
+                }
+                ++finished;
+                if (n > 1) work.notify_all();
+                else if (n == 1) work.notify_one();
+            }
+            if (running == 0 && (error || ready.empty())) {
+                work.notify_all();
+            }
+        }
+
+        void run () {
+            int max = parallel::max();
+            parallel::limit(share);     // the caller works too, restored below
+            std::unique_lock<std::mutex> lk(lock);
+            unsigned n = plan->tasks.size();
+            finished = 0;
+            error = nullptr;
+            for (unsigned i = 0; i < n; ++i) {
+                n_left[i] = plan->tasks[i].inputs.size();
+                if (n_left[i] == 0) {
+                    ready.push_back(i);
+                }
+            }
+            work.notify_all();
+            for (;;) {
+                work.wait(lk, [this]() { return !ready.empty() || running == 0; });
+                if (ready.empty()) break;
+                execute(lk, 0);
+            }
+            parallel::limit(max);
+            if (error) {
+                std::rethrow_exception(error);
+            }
+            BOOST_VERIFY(finished == n);
+        }
+    };
+
+    Plan::Plan (Model const &model): frozen(false), profiler(model.m_profiler.get()) {
         for (auto node: model.m_nodes) {
             const_cast<Node *>(node)->prepare(this);
         }
@@ -40,9 +177,63 @@ namespace argos {
                 tasks[it->second].outputs.push_back(i);
             }
         }
+        string sched = model.config().get<string>("argos.global.scheduler", "serial");
+        if (sched == "parallel") {
+            unsigned threads = model.config().get<unsigned>("argos.global.threads", std::thread::hardware_concurrency());
+            serializeSiblings(model);
+            scheduler = unique_ptr<Scheduler>(new Scheduler(this, std::max(threads, 1u)));
+            LOG(info) << "parallel scheduler with " << threads << " threads";
+        }
+        else if (sched != "serial") {
+            throw runtime_error("unknown scheduler: " + sched);
+        }
+        compile();
         frozen = true;
     }
 
+    Plan::~Plan () {
+    }
+
+    void Plan::serializeSiblings (Model const &model) {
+        // topological order of the tasks, so the added arcs never form a cycle
+        unsigned n = tasks.size();
+        vector<unsigned> order(n);
+        {
+            vector<unsigned> n_left(n);
+            vector<unsigned> ready;
+            for (unsigned i = 0; i < n; ++i) {
+                n_left[i] = tasks[i].inputs.size();
+                if (n_left[i] == 0) ready.push_back(i);
+            }
+            unsigned done = 0;
+            while (!ready.empty()) {
+                unsigned idx = ready.back();
+                ready.pop_back();
+                order[idx] = done++;
+                for (unsigned o: tasks[idx].outputs) {
+                    if (--n_left[o] == 0) ready.push_back(o);
+                }
+            }
+            BOOST_VERIFY(done == n);
+        }
+        for (Node *node: model.m_nodes) {
+            vector<pair<unsigned, unsigned>> siblings;  // (order, task)
+            for (auto const &pin: node->outputs()) {
+                auto it = lookup.find(make_pair(pin.node, TASK_UPDATE));
+                if (it == lookup.end()) continue;
+                siblings.push_back(make_pair(order[it->second], it->second));
+            }
+            sort(siblings.begin(), siblings.end());
+            siblings.erase(unique(siblings.begin(), siblings.end()), siblings.end());
+            for (unsigned i = 1; i < siblings.size(); ++i) {
+                unsigned from = siblings[i-1].second;
+                unsigned to = siblings[i].second;
+                tasks[to].inputs.push_back(tasks[from].id);
+                tasks[from].outputs.push_back(to);
+            }
+        }
+    }
+
     void Plan::print (ostream &os) const {
         for (auto const &task: tasks) {
             os << task.id << endl;
@@ -53,39 +244,201 @@ namespace argos {
     }
 
 
-    void Plan::run (bool dry) const {
-        BOOST_VERIFY(frozen);
+    void Plan::compile () {
         unsigned n = tasks.size();
-        unsigned done = 0;
         vector<unsigned> n_left(n);
-        stack<unsigned> ready;
-
-        // topologicall sort
+        vector<unsigned> current;
+        vector<unsigned> next;
         for (unsigned i = 0; i < n; ++i) {
-            n_left[i] = tasks[i].inputs.size();
+            Task &task = tasks[i];
+            if (task.closure) {
+                task.context = &task.closure;
+            }
+            n_left[i] = task.inputs.size();
             if (n_left[i] == 0) {
-                ready.push(i);
+                current.push_back(i);
             }
         }
+        steps.clear();
+        levels.clear();
+        // a task is placed in the level after the last of its inputs
+        while (!current.empty()) {
+            levels.push_back(steps.size());
+            for (unsigned idx: current) {
+                Task const &task = tasks[idx];
+                steps.push_back(Step{task.callback, task.context, idx});
+                for (unsigned o: task.outputs) {
+                    BOOST_VERIFY(n_left[o] > 0);
+                    --n_left[o];
+                    if (n_left[o] == 0) {
+                        next.push_back(o);
+                    }
+                }
+            }
+            current.swap(next);
+            next.clear();
+        }
+        levels.push_back(steps.size());
+        BOOST_VERIFY(steps.size() == n);
+        LOG(debug) << "plan compiled: " << n << " tasks in " << (levels.size() - 1) << " levels";
+    }
 
-        while (!ready.empty()) {
-            unsigned idx = ready.top();
-            ready.pop();
-            Task const &task = tasks[idx];
-            LOG(debug) << "RUN " << task.id;
-            if (!dry) {
-                task.callback();
-            }
-            for (unsigned o: task.outputs) {
-                BOOST_VERIFY(n_left[o] > 0);
-                --n_left[o];
-                if (n_left[o] == 0) {
-                    ready.push(o);
+    void Plan::closure () const {
+        BOOST_VERIFY(frozen);
+        unsigned n = tasks.size();
+        // transitive closure, outputs of a task are visited before the task
+        reach.assign(n, vector<bool>(n, false));
+        for (auto it = steps.rbegin(); it != steps.rend(); ++it) {
+            vector<bool> &r = reach[it->task];
+            for (unsigned o: tasks[it->task].outputs) {
+                r[o] = true;
+                vector<bool> const &ro = reach[o];
+                for (unsigned j = 0; j < n; ++j) {
+                    if (ro[j]) r[j] = true;
                 }
             }
-            ++done;
         }
-        BOOST_VERIFY(done == n);
+    }
+
+    void Plan::run (bool dry) const {
+        BOOST_VERIFY(frozen);
+        if (dry) {
+            for (Step const &step: steps) {
+                LOG(debug) << "RUN " << tasks[step.task].id;
+            }
+            return;
+        }
+        if (scheduler) {
+            scheduler->run();
+            return;
+        }
+        if (profiler) {
+            for (Step const &step: steps) {
+                Profiler::Clock::time_point begin = Profiler::Clock::now();
+                step.callback(step.context);
+                profiler->record(tasks[step.task].id, begin, Profiler::Clock::now(), 0);
+            }
+            return;
+        }
+        for (Step const &step: steps) {
+            step.callback(step.context);
+        }
+    }
+
+    void Profiler::Stat::add (double us) {
+        if (count == 0 || us < min) min = us;
+        if (count == 0 || us > max) max = us;
+        ++count;
+        total += us;
+        unsigned b = 0;
+        while (b + 1 < BUCKETS && us >= double(1UL << b)) ++b;
+        ++hist[b];
+    }
+
+    double Profiler::Stat::percentile (double p) const {
+        unsigned long target = std::ceil(count * p);
+        unsigned long acc = 0;
+        for (unsigned b = 0; b < BUCKETS; ++b) {
+            acc += hist[b];
+            if (acc >= target && acc > 0) {
+                // report the upper bound of the bucket, clipped by observed range
+                return std::min(max, std::max(min, double(1UL << b)));
+            }
+        }
+        return max;
+    }
+
+    Profiler::Profiler (string const &trace)
+        : m_epoch(Clock::now()), m_trace_path(trace) {
+    }
+
+    Profiler::~Profiler () {
+        if (m_trace.is_open()) {
+            m_trace << "\n]\n";
+        }
+    }
+
+    static void write_json_string (ostream &os, string const &str) {
+        os << '"';
+        for (char c: str) {
+            if (c == '"' || c == '\\') os << '\\';
+            os << c;
+        }
+        os << '"';
+    }
+
+    void Profiler::record (Plan::TaskId const &task, Clock::time_point begin, Clock::time_point end, unsigned tid) {
+        double ts = std::chrono::duration<double, std::micro>(begin - m_epoch).count();
+        double dur = std::chrono::duration<double, std::micro>(end - begin).count();
+        std::lock_guard<std::mutex> lk(m_lock);
+        m_stats[task].add(dur);
+        if (m_trace_path.empty()) return;
+        if (!m_trace.is_open()) {
+            m_trace.open(m_trace_path.c_str());
+            if (!m_trace) throw runtime_error("cannot open trace file " + m_trace_path);
+            m_trace << "[";
+        }
+        else {
+            m_trace << ",";
+        }
+        Node const *node = task.first;
+        m_trace << "\n{\"name\":";
+        write_json_string(m_trace, node->name());
+        m_trace << ",\"cat\":\"" << methodName(task.second)
+                << "\",\"ph\":\"X\",\"ts\":" << std::fixed << setprecision(3) << ts
+                << ",\"dur\":" << dur << ",\"pid\":0,\"tid\":" << tid
+                << ",\"args\":{\"type\":";
+        write_json_string(m_trace, node->type());
+        m_trace << "}}";
+        m_trace.unsetf(ios::floatfield);
+    }
+
+    void Profiler::report (ostream &os, bool reset) {
+        std::lock_guard<std::mutex> lk(m_lock);
+        vector<pair<double, Plan::TaskId>> order;
+        map<string, Stat> types;  // aggregated by node type and method
+        double total = 0;
+        for (auto const &p: m_stats) {
+            Stat const &st = p.second;
+            order.push_back(make_pair(-st.total, p.first));
+            total += st.total;
+            Stat &ty = types[p.first.first->type() + ":" + methodName(p.first.second)];
+            ty.count += st.count;
+            ty.total += st.total;
+        }
+        if (order.empty()) return;
+        sort(order.begin(), order.end());
+        ios::fmtflags flags = os.flags();
+        streamsize precision = os.precision();
+        os << std::fixed << setprecision(2);
+        os << setw(40) << "TASK" << setw(10) << "COUNT" << setw(12) << "TOTAL(ms)" << setw(8) << "%"
+           << setw(12) << "MEAN(us)" << setw(12) << "MIN(us)" << setw(12) << "P50(us)"
+           << setw(12) << "P99(us)" << setw(12) << "MAX(us)" << endl;
+        for (auto const &p: order) {
+            Stat const &st = m_stats[p.second];
+            ostringstream name;
+            name << p.second;
+            os << setw(40) << name.str() << setw(10) << st.count << setw(12) << st.total / 1000
+               << setw(8) << 100.0 * st.total / total << setw(12) << st.total / st.count
+               << setw(12) << st.min << setw(12) << st.percentile(0.5)
+               << setw(12) << st.percentile(0.99) << setw(12) << st.max << endl;
+        }
+        vector<pair<double, string>> type_order;
+        for (auto const &p: types) {
+            type_order.push_back(make_pair(-p.second.total, p.first));
+        }
+        sort(type_order.begin(), type_order.end());
+        os << setw(40) << "TYPE" << setw(10) << "COUNT" << setw(12) << "TOTAL(ms)" << setw(8) << "%" << endl;
+        for (auto const &p: type_order) {
+            Stat const &st = types[p.second];
+            os << setw(40) << p.second << setw(10) << st.count << setw(12) << st.total / 1000
+               << setw(8) << 100.0 * st.total / total << endl;
+        }
+        os.flags(flags);
+        os.precision(precision);
+        if (reset) {
+            m_stats.clear();
+        }
     }
 
     Node::Node (Model *model, Config const &config)
@@ -105,9 +458,9 @@ namespace argos {
             case MODE_TRAIN:
                 {
                     // add preupdate task
-                    plan->add(this, TASK_PREUPDATE, std::bind(&Node::preupdate, dynamic_cast<Node *>(this))).add(this, TASK_PREDICT);
+                    plan->add(this, TASK_PREUPDATE, &Plan::invoke<Node, &Node::preupdate>, this).add(this, TASK_PREDICT);
                     // add update task
-                    auto deps = plan->add(this, TASK_UPDATE, std::bind(&Node::update, dynamic_cast<Node *>(this)));
+                    auto deps = plan->add(this, TASK_UPDATE, &Plan::invoke<Node, &Node::update>, this);
                     deps.add(this, TASK_PREUPDATE);
                     for (auto &pin: m_outputs) {
                         deps.add(pin.node, TASK_UPDATE);
@@ -119,7 +472,7 @@ namespace argos {
                 // no break, need to add PREDICT tasks
             case MODE_PREDICT:
                 {
-                    auto deps = plan->add(this, TASK_PREDICT, std::bind(&Node::predict, this));
+                    auto deps = plan->add(this, TASK_PREDICT, &Plan::invoke<Node, &Node::predict>, this);
                     for (auto pin: m_inputs) {
                         deps.add(pin.node, TASK_PREDICT);
                     }
@@ -157,13 +510,53 @@ namespace argos {
 
     Library library;
 
+    // Model files start with a header recording the precision the
+    // parameters were stored in.  Files written before the header was
+    // introduced have none and always hold doubles.
+    // Version 1 is followed by the state of each node in turn.  Version 2
+    // is followed by the number of parameter values (uint64), then the
+    // parameter buffer and the gradient buffer of the model as they are in
+    // memory.
+    static char const MODEL_MAGIC[8] = {'A', 'R', 'G', 'O', 'S', 'M', 'D', 'L'};
+    static constexpr uint32_t MODEL_VERSION = 2;
+
+    struct ModelHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t real_size;     // sizeof of stored floating point values
+    };
+
+    static char const *precisionName (size_t size) {
+        if (size == sizeof(float)) return "float";
+        if (size == sizeof(double)) return "double";
+        return "unknown";
+    }
+
     Model::Model (Config const &config, Mode mode)
         : m_config(config),
         m_mode(mode),
         m_random(config.get<Random::result_type>("argos.global.seed", 2011)),
         m_run_server(config.get<int>("argos.server.disable", 0) == 0),
-        m_server(nullptr)
+        m_server(nullptr),
+        m_param_data(nullptr),
+        m_param_delta(nullptr),
+        m_param_size(0)
     {
+        memory::hugePages() = config.get<int>("argos.global.hugepage", 0) != 0;
+        parallel::grain() = config.get<size_t>("argos.global.grain", parallel::grain());
+        {
+            string precision = config.get<string>("argos.global.precision", precisionName(sizeof(real_t)));
+            if (precision != precisionName(sizeof(real_t))) {
+                throw runtime_error("model requires " + precision + " precision but argos is built with "
+                        + precisionName(sizeof(real_t)) + ", rebuild with make PRECISION=" + precision);
+            }
+        }
+        {
+            string trace = config.get<string>("argos.global.trace", "");
+            if (config.get<int>("argos.global.profile", 0) || trace.size()) {
+                m_profiler = unique_ptr<Profiler>(new Profiler(trace));
+            }
+        }
         { // create meta node
             Config cfg;
             cfg.put("type", "meta");
@@ -195,7 +588,13 @@ namespace argos {
             if (stat) {
                 m_stats.push_back(stat);
             }
+            role::Params *params = dynamic_cast<role::Params *>(node);
+            if (params) {
+                m_params.push_back(params);
+            }
         }
+        rewrite();
+        layoutParams();
     }
 
     Model::~Model () {
@@ -241,18 +640,268 @@ namespace argos {
         }
     }
 
+    void Model::rewrite () {
+        if (m_config.get<int>("argos.global.fuse", 1) == 0) return;
+        for (auto const &r: library.rewrites()) {
+            for (Node *node: m_nodes) {
+                if (r.second->apply(node)) {
+                    LOG(info) << "rewrite " << r.first << " applied to " << node->name() << ':' << node->type();
+                }
+            }
+        }
+    }
+
+    void Model::layoutParams () {
+        static constexpr size_t ALIGN_VALUES = memory::ALIGN / sizeof(real_t);
+        vector<size_t> offsets;
+        size_t total = 0;
+        for (role::Params *params: m_params) {
+            offsets.push_back(total);
+            total += (params->dim() + ALIGN_VALUES - 1) / ALIGN_VALUES * ALIGN_VALUES;
+        }
+        m_param_size = total;
+        if (total == 0) return;
+        bool grad = (m_mode != MODE_PREDICT);
+        vector<real_t, AlignedAllocator<real_t>> store(total, 0);
+        vector<real_t, AlignedAllocator<real_t>> grad_store(grad ? total : 0, 0);
+        real_t *data = &store[0];
+        real_t *delta = grad ? &grad_store[0] : nullptr;
+        for (unsigned i = 0; i < m_params.size(); ++i) {
+            m_params[i]->bindParams(data + offsets[i], grad ? delta + offsets[i] : nullptr);
+        }
+        m_param_store.swap(store);
+        m_grad_store.swap(grad_store);
+        m_param_data = data;
+        m_param_delta = delta;
+        LOG(info) << m_params.size() << " parameter nodes, " << total << " values";
+    }
+
+    void Model::sync (Model const &from) {
+        BOOST_VERIFY(m_nodes.size() == from.m_nodes.size());
+        BOOST_VERIFY(m_param_size == from.m_param_size);
+        for (role::Params const *params: from.m_params) {
+            params->flush();
+        }
+        std::copy(from.m_param_data, from.m_param_data + m_param_size, m_param_data);
+        if (m_param_delta && from.m_param_delta) {
+            std::copy(from.m_param_delta, from.m_param_delta + m_param_size, m_param_delta);
+        }
+        for (role::Params *params: m_params) {
+            params->replaced();
+        }
+        for (unsigned i = 0; i < m_nodes.size(); ++i) {
+            if (dynamic_cast<role::Params *>(m_nodes[i])) continue;
+            m_nodes[i]->sync(from.m_nodes[i]);
+        }
+    }
+
     void Model::save (string const &path) const {
         ofstream os(path.c_str(), ios::binary);
-        for (Node const *node: m_nodes) {
-            node->save(os);
+        ModelHeader header;
+        std::copy(MODEL_MAGIC, MODEL_MAGIC + sizeof(MODEL_MAGIC), header.magic);
+        header.version = MODEL_VERSION;
+        header.real_size = sizeof(real_t);
+        os.write(reinterpret_cast<char const *>(&header), sizeof(header));
+        for (role::Params const *params: m_params) {
+            params->flush();
+        }
+        uint64_t size = m_param_size;
+        os.write(reinterpret_cast<char const *>(&size), sizeof(size));
+        size_t bytes = sizeof(real_t) * m_param_size;
+        if (bytes == 0) return;
+        os.write(reinterpret_cast<char const *>(m_param_data), bytes);
+        if (m_param_delta) {
+            os.write(reinterpret_cast<char const *>(m_param_delta), bytes);
+        }
+        else {  // same layout for prediction models
+            vector<char> zero(bytes, 0);
+            os.write(&zero[0], bytes);
         }
     }
 
     void Model::load (string const &path) {
         ifstream is(path.c_str(), ios::binary);
+        if (!is) throw runtime_error("cannot open model file " + path);
+        ModelHeader header;
+        is.read(reinterpret_cast<char *>(&header), sizeof(header));
+        size_t real_size = sizeof(double);
+        uint32_t version = 0;
+        if (is && std::equal(MODEL_MAGIC, MODEL_MAGIC + sizeof(MODEL_MAGIC), header.magic)) {
+            real_size = header.real_size;
+            version = header.version;
+        }
+        else {  // legacy headerless file
+            is.clear();
+            is.seekg(0);
+        }
+        if (real_size != sizeof(real_t)) {
+            throw runtime_error(string("model ") + path + " stores " + precisionName(real_size)
+                    + " parameters but argos is built with " + precisionName(sizeof(real_t)));
+        }
+        if (version > MODEL_VERSION) {
+            throw runtime_error(string("model ") + path + " is of a newer version");
+        }
+        if (version < 2) {
+            for (Node *node: m_nodes) {
+                node->load(is);
+            }
+            return;
+        }
+        uint64_t size;
+        is.read(reinterpret_cast<char *>(&size), sizeof(size));
+        if (!is || size != m_param_size) {
+            throw runtime_error(string("model ") + path + " does not match the architecture");
+        }
+        size_t bytes = sizeof(real_t) * m_param_size;
+        if (bytes == 0) return;
+        is.read(reinterpret_cast<char *>(m_param_data), bytes);
+        if (m_param_delta) {
+            is.read(reinterpret_cast<char *>(m_param_delta), bytes);
+        }
+        else {
+            is.ignore(bytes);
+        }
+        if (!is) throw runtime_error(string("model ") + path + " is truncated");
+        for (role::Params *params: m_params) {
+            params->replaced();
+        }
+    }
+
+    void Model::planMemory (Plan const &plan) {
+        if (config().get<int>("argos.global.memplan", 0) == 0) return;
+        static constexpr size_t ALIGN = memory::ALIGN;
+        static Method const METHODS[] = {TASK_PREDICT, TASK_PREUPDATE, TASK_UPDATE, TASK_USER};
+        // activations computed in-place share one buffer
+        struct Buffer {
+            size_t size;
+            size_t offset;
+            vector<role::Transient *> nodes;
+            vector<Plan::TaskId> uses;  // tasks writing or reading the buffer
+        };
+        vector<Buffer> buffers;
+        map<Node const *, unsigned> group;
+        size_t total = 0;
+        for (Node *node: m_nodes) {
+            role::Transient *t = dynamic_cast<role::Transient *>(node);
+            if (t == nullptr) continue;
+            size_t size = t->activationSize();
+            if (size == 0) continue;    // not transient, e.g. parameters in the model's store
+            t->bindActivation(nullptr); // release previous plan
+            if (!plan.has(make_pair(node, TASK_PREDICT))) continue;
+            total += size;
+            // In-place is safe if the input is only consumed by this node,
+            // and the input's own update doesn't need the activation.
+            Node const *input = t->inplace();
+            auto it = (input == nullptr) ? group.end() : group.find(input);
+            if (it != group.end()) {
+                role::Transient const *ti = dynamic_cast<role::Transient const *>(input);
+                if (ti->activationSize() == size
+                        && input->outputs().size() == 1
+                        && (m_mode == MODE_PREDICT || !ti->activationUsedByUpdate())) {
+                    group[node] = it->second;
+                    buffers[it->second].nodes.push_back(t);
+                    continue;
+                }
+            }
+            group[node] = buffers.size();
+            buffers.push_back(Buffer{size, 0, {t}, {}});
+        }
+        // readers of activations besides the outputs, e.g. fused consumers
+        map<Node const *, vector<Node const *>> readers;
+        for (Node *node: m_nodes) {
+            role::Transient const *t = dynamic_cast<role::Transient const *>(node);
+            if (t == nullptr) continue;
+            for (Node const *source: t->reads()) {
+                readers[source].push_back(node);
+            }
+        }
+        auto addReaders = [&readers](Node const *node, vector<Node const *> *users) {
+            auto it = readers.find(node);
+            if (it == readers.end()) return;
+            users->insert(users->end(), it->second.begin(), it->second.end());
+        };
+        for (auto const &p: group) {
+            Buffer &buf = buffers[p.second];
+            vector<Node const *> users{p.first};
+            addReaders(p.first, &users);
+            for (auto const &pin: p.first->outputs()) {
+                users.push_back(pin.node);
+                // nodes sharing the activation pass it on to their outputs
+                role::Transient const *t = dynamic_cast<role::Transient const *>(pin.node);
+                if (t && t->shares() == p.first) {
+                    addReaders(pin.node, &users);
+                    for (auto const &pin2: pin.node->outputs()) {
+                        users.push_back(pin2.node);
+                    }
+                }
+            }
+            for (Node const *user: users) {
+                for (Method method: METHODS) {
+                    Plan::TaskId task(user, method);
+                    if (plan.has(task)) buf.uses.push_back(task);
+                }
+            }
+        }
+        // Two buffers can overlap if all uses of one precede all uses of
+        // the other.
+        auto before = [&plan](Buffer const &a, Buffer const &b) {
+            for (auto const &u: a.uses) {
+                for (auto const &v: b.uses) {
+                    if (!plan.precedes(u, v)) return false;
+                }
+            }
+            return true;
+        };
+        // greedy first-fit, largest buffers first
+        vector<unsigned> order(buffers.size());
+        for (unsigned i = 0; i < order.size(); ++i) order[i] = i;
+        sort(order.begin(), order.end(), [&buffers](unsigned a, unsigned b) {
+                return buffers[a].size > buffers[b].size;
+        });
+        size_t arena_size = 0;
+        vector<unsigned> placed;
+        for (unsigned i: order) {
+            Buffer &buf = buffers[i];
+            vector<Buffer const *> conflicts;
+            for (unsigned j: placed) {
+                Buffer const &other = buffers[j];
+                if (!before(buf, other) && !before(other, buf)) {
+                    conflicts.push_back(&other);
+                }
+            }
+            sort(conflicts.begin(), conflicts.end(), [](Buffer const *a, Buffer const *b) {
+                    return a->offset < b->offset;
+            });
+            size_t offset = 0;
+            for (Buffer const *c: conflicts) {
+                if (c->offset + c->size <= offset) continue;
+                if (offset + buf.size <= c->offset) break;
+                offset = (c->offset + c->size + ALIGN - 1) / ALIGN * ALIGN;
+            }
+            buf.offset = offset;
+            arena_size = std::max(arena_size, offset + buf.size);
+            placed.push_back(i);
+        }
+        vector<char, AlignedAllocator<char>> arena(arena_size);
+        uintptr_t base = reinterpret_cast<uintptr_t>(arena.data());
+        for (Buffer const &buf: buffers) {
+            for (role::Transient *t: buf.nodes) {
+                t->bindActivation(reinterpret_cast<void *>(base + buf.offset));
+            }
+        }
+        m_arena.swap(arena);
+        // activations made views of others by rewrites (e.g. a fused
+        // relu on its linear) are already sharing, count them in
+        unsigned views = 0;
         for (Node *node: m_nodes) {
-            node->load(is);
+            role::Transient const *t = dynamic_cast<role::Transient const *>(node);
+            if (t == nullptr || t->shares() == nullptr || group.count(t->shares()) == 0) continue;
+            total += dynamic_cast<role::Transient const *>(t->shares())->activationSize();
+            ++views;
         }
+        LOG(info) << "memory plan: " << (group.size() + views) << " activations (" << views
+                  << " views set up by rewrites) of " << total
+                  << " bytes placed in " << arena_size << " bytes";
     }
 
     void Model::init () { // init model
@@ -284,6 +933,7 @@ namespace argos {
 
     void Model::train (ostream &os) {
         Plan plan(*this);
+        planMemory(plan);
         unsigned report = config().get<unsigned>("argos.global.report", 100);
         unsigned snapshot = config().get<unsigned>("argos.global.snapshot", 0);
         unsigned maxloop = config().get<unsigned>("argos.global.maxloop", 0);
@@ -319,6 +969,7 @@ namespace argos {
 
     void Model::predict (ostream &os) {
         Plan plan(*this);
+        planMemory(plan);
         m_input->rewind();
         for (;;) {
             try {
@@ -355,6 +1006,12 @@ namespace argos {
             }
             if (reset) stat->reset();
         }
+        if (m_profiler) {
+            color(ccolor::fore::magenta);
+            os << "profile" << endl;
+            color(ccolor::fore::console);
+            m_profiler->report(os, reset);
+        }
     }
 
     void Model::verify (string const &node, double epsilon, size_t sample) {
@@ -363,6 +1020,7 @@ namespace argos {
         if (mode() != MODE_TRAIN) throw runtime_error("verify most be run with MODE_TRAIN");
 
         Plan plan(*this);
+        planMemory(plan);
         stringstream ss;
         // save all nodes to stream to keep status
         for (Node const *node: m_nodes) {
@@ -374,7 +1032,7 @@ namespace argos {
         {   // initialize indices, sample if needed
             for (unsigned i = 0; i < n; ++i) index[i] = i;
             if (sample > 0 && sample < n) {
-                random_shuffle(index.begin(), index.end());
+                std::shuffle(index.begin(), index.end(), m_random);
                 index.resize(sample);
             }
         }
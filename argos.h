@@ -8,8 +8,17 @@
 #include <stdexcept>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <fstream>
+#include <deque>
+#include <future>
 #include <random>
 #include <functional>
+#include <algorithm>
 #include <boost/assert.hpp>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/accumulators/accumulators.hpp>
@@ -24,6 +33,7 @@
 #define LOG(x) BOOST_LOG_TRIVIAL(x)
 
 #include <http++.h>
+#include "array.h"
 
 namespace argos {
 
@@ -70,6 +80,7 @@ namespace argos {
 
     class Node;
     class Model;
+    class Profiler;
 
     /// Network running plan (predict or train).
     /**
@@ -84,30 +95,74 @@ namespace argos {
      * the same method call on the same Node object.
      *
      * The scheduling of a plan can be done via topological sort of the graph.
-     * For now, we only do sequantial scheduling.  But we can potentially 
-     * support runing all ready tasks in parallel.
+     * By default we do sequential scheduling.  With
+     * "argos.global.scheduler" set to "parallel", all ready tasks are
+     * dispatched to a pool of "argos.global.threads" workers, each
+     * limited to its share of the OpenMP threads.
      *
      */
     class Plan {
     public:
         typedef pair<Node const *, Method> TaskId;  // use node ptr and method tag to uniquely identify a method
+        /// Raw task callback, invoked with the context given to add.
+        typedef void (*Callback) (void *);
+
+        /// Callback invoking a method of a node, e.g. invoke<Node, &Node::predict>.
+        template <typename T, void (T::*METHOD)()>
+        static void invoke (void *node) {
+            (static_cast<T *>(node)->*METHOD)();
+        }
     private:
         struct Task {
             TaskId id;
-            function<void ()> callback;
+            Callback callback;
+            void *context;
+            // Only used by tasks added with a function object.
+            function<void ()> closure;
             // The tasks this one depends on.
             vector<TaskId> inputs;
-            // The tasks that depend on this one, identified by index into the 
+            // The tasks that depend on this one, identified by index into the
             // "tasks" vector below.
             vector<unsigned> outputs;
         };
+        // One entry of the compiled schedule.
+        struct Step {
+            Callback callback;
+            void *context;
+            unsigned task;  // index into "tasks"
+        };
+        struct Scheduler;
         bool frozen;
         vector<Task> tasks;
         // mapping TaskId to index to the "tasks" vector.
         map<TaskId, unsigned> lookup;
+        // Compiled at freeze time: callbacks in topological order, grouped
+        // by dependency level.  Tasks of level i are steps[levels[i]] to
+        // steps[levels[i+1]-1], and only depend on tasks of lower levels.
+        vector<Step> steps;
+        vector<unsigned> levels;
+        // reach[i][j]: task j depends directly or indirectly on task i,
+        // computed on the first precedes() (only the memory planner asks).
+        mutable vector<vector<bool>> reach;
+        // worker pool, only present for parallel scheduling.
+        unique_ptr<Scheduler> scheduler;
+        // task timing, only present when profiling.
+        Profiler *profiler;
+
+        static void callClosure (void *closure) {
+            (*static_cast<function<void ()> *>(closure))();
+        }
+        // Order the UPDATE tasks of nodes sharing an input, as they all
+        // accumulate into the delta of that input.
+        void serializeSiblings (Model const &model);
+        // Build steps and levels.
+        void compile ();
+        // fill reach
+        void closure () const;
     public:
         /// Constructor, from model and mode.
         Plan (Model const &model);
+        ~Plan ();
 
         friend class Deps;
         // A helper class to facilitate adding dependencies.
@@ -128,7 +183,7 @@ namespace argos {
          * The return value is a Deps object for adding dependencies of this
          * task.  For example,
          *
-         *     plan.add(node, METHOD_PREDICT, [](){...})  // adding the task itself
+         *     plan.add(node, METHOD_PREDICT, &Plan::invoke<Node, &Node::predict>, node)  // adding the task itself
          *    .add(input_node_1, METHOD_PREDICT)          // add dependency 1.
          *    .add(input_node_2, METHOD_PREDICT);         // add dependency 2.
          *
@@ -136,24 +191,86 @@ namespace argos {
          * plan.  All reference to tasks to be added in future is resolved after
          * all tasks have been added.
          */
-        Deps add (Node const *node, Method method, function<void()> callback) {
+        Deps add (Node const *node, Method method, Callback callback, void *context) {
             BOOST_VERIFY(!frozen);
             unsigned idx = tasks.size();
             Task task;
             task.id = make_pair(node, method);
             task.callback = callback;
+            task.context = context;
             BOOST_VERIFY(lookup.find(task.id) == lookup.end());
             lookup[task.id] = tasks.size();
             tasks.push_back(task);
             return Deps(this, idx);
         }
 
+        /// Add a task with a function object as callback.
+        /** Slower than raw callbacks as the call goes through std::function. */
+        Deps add (Node const *node, Method method, function<void()> callback) {
+            Deps deps = add(node, method, &Plan::callClosure, nullptr);
+            tasks.back().closure = callback;
+            return deps;
+        }
+
+        /// Test if the plan contains a task.
+        bool has (TaskId const &task) const {
+            return lookup.count(task) > 0;
+        }
+
+        /// Test if task a always finishes before task b starts.
+        bool precedes (TaskId const &a, TaskId const &b) const {
+            if (reach.empty()) closure();
+            return reach[lookup.at(a)][lookup.at(b)];
+        }
+
         /// Print plan to the screen.
         void print (ostream &) const;
         /// Run the plan.
         void run (bool dry = false) const;
     };
 
+    /// Per-task profiler.
+    /**
+     * Enabled with "argos.global.profile", or by setting "argos.global.trace"
+     * to a path.  Every task run by a plan is timed, and the model report
+     * includes a table of the time spent in each task and node type.
+     * With a trace path, each task execution is also written as a Chrome
+     * trace event, which can be loaded in chrome://tracing or Perfetto.
+     * The trace grows with every iteration, so use it with a bounded maxloop.
+     */
+    class Profiler {
+    public:
+        typedef std::chrono::steady_clock Clock;
+        /// Number of histogram buckets, bucket i counts durations in [2^(i-1), 2^i) microseconds.
+        static constexpr unsigned BUCKETS = 32;
+        struct Stat {
+            unsigned long count;
+            double total;   // in microseconds
+            double min;
+            double max;
+            array<unsigned long, BUCKETS> hist;
+            Stat (): count(0), total(0), min(0), max(0) {
+                hist.fill(0);
+            }
+            void add (double us);
+            /// Approximate percentile from histogram.
+            double percentile (double p) const;
+        };
+    private:
+        std::mutex m_lock;
+        map<Plan::TaskId, Stat> m_stats;
+        Clock::time_point m_epoch;
+        string m_trace_path;
+        ofstream m_trace;       // opened with the first event
+    public:
+        Profiler (string const &trace);
+        ~Profiler ();
+        /// Record one execution of a task by thread tid.
+        void record (Plan::TaskId const &task, Clock::time_point begin, Clock::time_point end, unsigned tid);
+        /// Print the aggregate tables.
+        void report (ostream &os, bool reset);
+    };
+
 
     /// Node factory.
     /** The system keeps a registry that maps strings to node factories,
@@ -184,6 +301,21 @@ namespace argos {
         }
     };
 
+    /// Graph rewrite, e.g. fusion of a node with its consumer.
+    /**
+     * Rewrites registered with the library are tried, in the order they
+     * were registered, on every node of a model after all nodes have been
+     * created and before any plan is built; "argos.global.fuse" = 0 turns
+     * them off.  A rewrite changes how matched nodes compute, not the graph:
+     * all nodes and their tasks remain, and a fused node leaves its work to
+     * the node it is fused with.  Plugins register their own rewrites from
+     * ArgosRegisterLibrary (see Library::load).
+     */
+    struct Rewrite {
+        virtual ~Rewrite() {}
+        /// Rewrite node, and the nodes around it, if they match; return whether anything was changed.
+        virtual bool apply (Node *node) const = 0;
+    };
 
     /// The abstract node class.
     /** Node must be constructed with a fixed mode -- the mode of the model. */
@@ -237,8 +369,8 @@ namespace argos {
         Mode mode () const;
         string const &name () const { return m_name; }
         string const &type () const { return m_type; }
-        vector<Pin> const &inputs () { return m_inputs; }
-        vector<Pin> const &outputs () { return m_outputs; }
+        vector<Pin> const &inputs () const { return m_inputs; }
+        vector<Pin> const &outputs () const { return m_outputs; }
 
         Node *findInput (string const &name) {
             auto it = m_lookup.find(name);
@@ -308,14 +440,129 @@ namespace argos {
             virtual void rewind () = 0;
         };
 
+        /// Input producing samples in batches.
+        /**
+         * With prefetch depth n > 0, the next n batches are loaded, one
+         * after the other, by a background loader thread while the model
+         * runs.  The thread lives as long as the node, so its OpenMP team
+         * and thread-local state are reused from batch to batch.  The node then
+         * implements loadBatch, filling one of n private slots, and
+         * swapBatch, exchanging a loaded slot with the buffers the rest of
+         * the model reads, and calls fetch from predict.  Batch indices
+         * are still drawn in the foreground, so the sequence of batches is
+         * the same with or without prefetch.  They are shuffled with the
+         * node's own engine, seeded from the model's at init, so the order
+         * does not depend on what other threads draw.  A node with prefetch
+         * must call stop in its destructor, before its slots are destroyed.
+         */
         class BatchInput: public virtual Input {
             unsigned m_mode;
             unsigned m_batch;
             unsigned m_off;
             vector<unsigned> m_index;
+            std::mt19937 m_random;
+            // prefetch
+            unsigned m_prefetch;
+            vector<unsigned> m_free;    // slots not being loaded
+            deque<pair<unsigned, std::future<void>>> m_pending;   // slots being loaded, in batch order
+            // loader thread, started by the first launch
+            std::thread m_loader;
+            std::mutex m_lock;
+            std::condition_variable m_work;
+            deque<std::packaged_task<void()>> m_jobs;   // protected by m_lock
+            bool m_quit;
+
+            void load () {
+                std::unique_lock<std::mutex> lk(m_lock);
+                for (;;) {
+                    m_work.wait(lk, [this]() { return m_quit || !m_jobs.empty(); });
+                    if (m_jobs.empty()) break;
+                    std::packaged_task<void()> job = std::move(m_jobs.front());
+                    m_jobs.pop_front();
+                    lk.unlock();
+                    job();
+                    lk.lock();
+                }
+            }
+
+            // Load batches into free slots.
+            void launch () {
+                if (!m_loader.joinable()) {
+                    m_quit = false;
+                    m_loader = std::thread([this]() { load(); });
+                }
+                while (!m_free.empty()) {
+                    vector<unsigned> index;
+                    if (!draw(&index)) break;
+                    unsigned slot = m_free.back();
+                    m_free.pop_back();
+                    std::packaged_task<void()> job([this, slot, index]() {
+                        loadBatch(slot, index);
+                    });
+                    m_pending.push_back(make_pair(slot, job.get_future()));
+                    {
+                        std::lock_guard<std::mutex> lk(m_lock);
+                        m_jobs.push_back(std::move(job));
+                    }
+                    m_work.notify_one();
+                }
+            }
+        protected:
+            /// Slot argument of loadBatch for loading into the current buffers.
+            static constexpr unsigned CURRENT = unsigned(-1);
+            /// Load examples of given indices into a slot.
+            /** Called from a background thread with prefetch, and with
+             * slot CURRENT in the foreground without.
+             */
+            virtual void loadBatch (unsigned slot, vector<unsigned> const &index) {
+                BOOST_VERIFY(0);
+            }
+            /// Exchange slot with the current buffers.
+            virtual void swapBatch (unsigned slot) {
+                BOOST_VERIFY(0);
+            }
+            /// Make the next batch current, using loadBatch and swapBatch.
+            /** Throws StopIterationException when data are exhausted. */
+            void fetch () {
+                if (m_prefetch == 0) {
+                    vector<unsigned> index;
+                    if (!draw(&index)) throw StopIterationException();
+                    loadBatch(CURRENT, index);
+                    return;
+                }
+                launch();
+                if (m_pending.empty()) throw StopIterationException();
+                unsigned slot = m_pending.front().first;
+                std::future<void> ready = std::move(m_pending.front().second);
+                m_pending.pop_front();
+                m_free.push_back(slot);
+                ready.get();    // rethrows exception of loading
+                swapBatch(slot);
+                launch();
+            }
+            /// Wait for all pending loads, which are discarded.
+            void stop () {
+                for (auto &p: m_pending) {
+                    p.second.wait();
+                    m_free.push_back(p.first);
+                }
+                m_pending.clear();
+            }
         public:
-            void init (unsigned batch, unsigned sz, Mode mode) {
+            ~BatchInput () {
+                if (m_loader.joinable()) {
+                    {
+                        std::lock_guard<std::mutex> lk(m_lock);
+                        m_quit = true;
+                    }
+                    m_work.notify_all();
+                    m_loader.join();
+                }
+            }
+            /// Random is the model's engine, which seeds the node's own.
+            void init (unsigned batch, unsigned sz, Mode mode, unsigned prefetch, std::mt19937 &random) {
                 m_mode = mode;
+                m_random.seed(random());
                 m_batch = batch;
                 m_off = 0;
                 m_index.resize(sz);
@@ -323,27 +570,47 @@ namespace argos {
                 if (m_mode  == MODE_TRAIN) {
                     m_off = sz; // so that index will be shuffled when next is called
                 }
+                m_prefetch = prefetch;
+                m_free.clear();
+                for (unsigned i = 0; i < prefetch; ++i) m_free.push_back(prefetch - 1 - i);
             }
             unsigned batch () const {
                 return m_batch;
             }
+            /// Number of slots of prefetching, 0 for synchronous loading.
+            unsigned prefetch () const {
+                return m_prefetch;
+            }
             void rewind () {
+                stop();
                 m_off = 0;
             }
-            void next (function<void(unsigned)> callback) {
+            /// Draw indices of the next batch, returns false if data are exhausted.
+            bool draw (vector<unsigned> *index) {
                 if (m_off + m_batch > m_index.size()) {
                     if (m_mode == MODE_TRAIN) {
-                        rewind();
-                        random_shuffle(m_index.begin(), m_index.end());
+                        m_off = 0;
+                        std::shuffle(m_index.begin(), m_index.end(), m_random);
                         BOOST_VERIFY(m_off + m_batch <= m_index.size());
                     }
                 }
                 if (m_off >= m_index.size()) {
-                    throw StopIterationException();
+                    return false;
                 }
+                index->clear();
                 for (unsigned b = 0; b < m_batch; ++b) {
                     if (m_off >= m_index.size()) break;
-                    callback(m_index[m_off++]);
+                    index->push_back(m_index[m_off++]);
+                }
+                return true;
+            }
+            void next (function<void(unsigned)> callback) {
+                vector<unsigned> index;
+                if (!draw(&index)) {
+                    throw StopIterationException();
+                }
+                for (unsigned i: index) {
+                    callback(i);
                 }
             }
         };
@@ -434,6 +701,62 @@ namespace argos {
             virtual void perturb (size_t index, double epsilon) = 0;
             virtual double gradient (size_t index) const = 0;
             virtual double value (size_t index) const = 0;
+            /// Move values and gradients to external storage of dim() each.
+            /** The model keeps the parameters of all nodes in one buffer,
+             * and the gradients in another.  delta is nullptr when there
+             * are no gradients (prediction).  Content is preserved. */
+            virtual void bindParams (real_t *data, real_t *delta) = 0;
+            /// Make the storage current before it is read as a whole.
+            virtual void flush () const {}
+            /// Notify that the storage was overwritten as a whole.
+            virtual void replaced () {}
+        };
+
+        /// Node with activation storage that can be planned by the model.
+        /**
+         * An activation is transient if every predict task of the node
+         * rewrites it completely from the inputs.  With
+         * "argos.global.memplan", the model packs transient activations
+         * into a shared arena, and two activations share memory when all
+         * uses of one finish before the other is written.  In prediction
+         * mode this takes about half the memory of unplanned activations
+         * (2.1-2.4x on the cifar examples).  In training mode, activations
+         * are alive until back-propagation, so only in-place pairs share
+         * memory, which saves about 10%; with the default rewrites
+         * ("argos.global.fuse") the linear-activation fusion already makes
+         * those pairs share, and the plan saves next to nothing more.
+         */
+        class Transient: public virtual Role {
+        public:
+            /// Size of activation in bytes, 0 if the activation is not transient.
+            virtual size_t activationSize () const = 0;
+            /// Whether the update task of the node reads its activation.
+            virtual bool activationUsedByUpdate () const = 0;
+            /// The input this node can compute its activation in-place on, or nullptr.
+            virtual Node const *inplace () const = 0;
+            /// Set the activation storage, nullptr for the node's own storage.
+            virtual void bindActivation (void *) = 0;
+            /// The node whose activation this node's activation is a view of, or nullptr.
+            /** Such a node is not transient itself; its users are users of
+             * the other node's storage. */
+            virtual Node const *shares () const { return nullptr; }
+            /// Nodes other than its inputs whose activation this node reads.
+            /** Set up by rewrites; the memory planner keeps their storage
+             * until this node is done with it. */
+            virtual vector<Node const *> reads () const { return vector<Node const *>(); }
+        };
+
+        /// Node that can produce its activation as a sparse matrix.
+        /**
+         * In sparse mode the activation is a CSR matrix with one row per
+         * sample, and the dense activation has its shape but no storage.
+         * Consumers that support it (e.g. linear) detect the mode and
+         * read sparse() instead.  Sparse activations have no delta.
+         */
+        class SparseActivation: public virtual Role {
+        public:
+            virtual bool isSparse () const = 0;
+            virtual SparseArray<> const &sparse () const = 0;
         };
     }
 
@@ -443,10 +766,15 @@ namespace argos {
         map<string, void *> m_modules;
         /// Factory registry.
         map<string, NodeFactory *> m_fac;
+        /// Rewrites, in registration order.
+        vector<pair<string, Rewrite *>> m_rewrites;
         void cleanupFactories () {
             for (auto &v: m_fac) {
                 delete v.second;
             }
+            for (auto &v: m_rewrites) {
+                delete v.second;
+            }
         }
         void registerInternalFactories ();
         void cleanupModules ();
@@ -469,6 +797,17 @@ namespace argos {
         void registerClass (string const &name) {
             registerFactory(name, new NodeFactoryImpl<T>);
         }
+        /// Register a rewrite, tried after those registered before.
+        void registerRewrite (string const &name, Rewrite *rewrite) {
+            BOOST_VERIFY(rewrite);
+            for (auto const &v: m_rewrites) {
+                BOOST_VERIFY(v.first != name);
+            }
+            m_rewrites.push_back(make_pair(name, rewrite));
+        }
+        vector<pair<string, Rewrite *>> const &rewrites () const {
+            return m_rewrites;
+        }
         /// A shared library must export entry function of this type, named "ArgusRegisterLibrary".
         typedef void (*ArgosRegisterLibraryFunctionType) (Library *);
         /// Load factories from a shared library.
@@ -508,6 +847,25 @@ namespace argos {
         bool m_run_server;
         http::server::server *m_server;
 
+        unique_ptr<Profiler> m_profiler;
+
+        // storage of planned activations
+        vector<char, AlignedAllocator<char>> m_arena;
+        // Place transient activations in m_arena according to task order of plan.
+        void planMemory (Plan const &plan);
+
+        // parameters of all nodes, and separately their gradients
+        vector<role::Params *> m_params;
+        vector<real_t, AlignedAllocator<real_t>> m_param_store;
+        vector<real_t, AlignedAllocator<real_t>> m_grad_store;
+        real_t *m_param_data;       // m_param_store
+        real_t *m_param_delta;      // m_grad_store, nullptr without gradients
+        size_t m_param_size;        // values, including alignment gaps
+        void layoutParams ();
+
+        // Apply the rewrites of the library, see Rewrite.
+        void rewrite ();
+
         void startServer ();
         void stopServer () {
             m_server->wait_stop();
@@ -517,7 +875,10 @@ namespace argos {
         Model (Config const &config, Mode mode);
         ~Model ();
 
+        /// Clone the architecture of a model, e.g. for periodic evaluation.
+        /** The clone is not profiled, so it doesn't write to the trace of the original. */
         Model (Model const &from, Mode mode): Model(from.config(), mode) {
+            m_profiler.reset();
         }
 
         Mode mode () const { return m_mode;}
@@ -543,12 +904,17 @@ namespace argos {
         void load (string const &path); // load
         void save (string const &path) const;
         /// Synchronize from another model of the same architecture.
-        void sync (Model const &from) {
-            BOOST_VERIFY(m_nodes.size() == from.m_nodes.size());
-            for (unsigned i = 0; i < m_nodes.size(); ++i) {
-                m_nodes[i]->sync(from.m_nodes[i]);
-            }
-        }
+        void sync (Model const &from);
+
+        /// Parameters of all nodes in one buffer of paramSize() values.
+        /** Nodes start at 64-byte boundaries, gaps are zero.  Lazily
+         * updated parameters must be flushed before being read. */
+        real_t *paramData () { return m_param_data; }
+        real_t const *paramData () const { return m_param_data; }
+        /// Gradients, laid out as paramData(); nullptr in prediction.
+        real_t *paramDelta () { return m_param_delta; }
+        real_t const *paramDelta () const { return m_param_delta; }
+        size_t paramSize () const { return m_param_size; }
 
         void predict (ostream &os = cerr);
         void train (ostream &os = cerr);
@@ -7,6 +7,14 @@
 #include <array>
 #include <vector>
 #include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <new>
+#include <utility>
+#include <sys/mman.h>
+#include <boost/assert.hpp>
+#include "simd.h"
+#include "parallel.h"
 
 namespace argos {
     
@@ -20,8 +28,97 @@ namespace argos {
     using std::pair;
     using std::make_pair;
 
+    // Floating point type of model data, selected at build time,
+    // e.g. "make PRECISION=float".  Every node works on Array<>, so this
+    // switches the whole engine (data, deltas and parameters) at once.
+#ifndef ARGOS_REAL
+#define ARGOS_REAL double
+#endif
+    typedef ARGOS_REAL real_t;
+
+    // Storage of arrays: aligned to 64 bytes (a cache line, and enough for
+    // any SIMD load), and optionally on transparent huge pages, which
+    // saves TLB misses on large activations and weights.
+    namespace memory {
+        static constexpr size_t ALIGN = 64;
+        static constexpr size_t HUGE_PAGE = 2 * 1024 * 1024;
+
+        // Allocate blocks of HUGE_PAGE or more on huge pages,
+        // set from "argos.global.hugepage" by the model.
+        inline bool &hugePages () {
+            static bool enabled = false;
+            return enabled;
+        }
+
+        inline void *allocate (size_t bytes) {
+            bool huge = hugePages() && bytes >= HUGE_PAGE;
+            void *ptr = nullptr;
+            if (posix_memalign(&ptr, huge ? HUGE_PAGE : ALIGN, bytes) != 0) {
+                throw std::bad_alloc();
+            }
+#ifdef MADV_HUGEPAGE
+            if (huge) {
+                madvise(ptr, bytes, MADV_HUGEPAGE);     // just a hint
+            }
+#endif
+            return ptr;
+        }
+
+        inline void deallocate (void *ptr) {
+            free(ptr);
+        }
+    }
+
+    // Allocator of array storage.  Elements are default-initialized, so
+    // numbers are not zeroed when an array is resized; fill if needed.
+    template <typename T>
+    class AlignedAllocator {
+    public:
+        typedef T value_type;
+        template <typename U>
+        struct rebind {
+            typedef AlignedAllocator<U> other;
+        };
+
+        AlignedAllocator () {
+        }
+
+        template <typename U>
+        AlignedAllocator (AlignedAllocator<U> const &) {
+        }
+
+        T *allocate (size_t n) {
+            return static_cast<T *>(memory::allocate(n * sizeof(T)));
+        }
+
+        void deallocate (T *ptr, size_t) {
+            memory::deallocate(ptr);
+        }
+
+        template <typename U>
+        void construct (U *ptr) {
+            ::new (static_cast<void *>(ptr)) U;
+        }
+
+        template <typename U, typename... Args>
+        void construct (U *ptr, Args&&... args) {
+            ::new (static_cast<void *>(ptr)) U(std::forward<Args>(args)...);
+        }
+
+        template <typename U>
+        bool operator == (AlignedAllocator<U> const &) const {
+            return true;
+        }
+
+        template <typename U>
+        bool operator != (AlignedAllocator<U> const &) const {
+            return false;
+        }
+    };
+
     // Multiple dimensional array.
-    template <typename T = double>    // align to cache line?
+    // Storage comes from Alloc, by default aligned and not zeroed.
+    template <typename T = real_t, typename Alloc = AlignedAllocator<T>>
     class Array {
     public:
         static constexpr size_t max_dim = 32;
@@ -31,9 +128,12 @@ namespace argos {
         array<size_t, max_dim> m_size;   // e.g.     5, 4, 6
         array<size_t, max_dim> m_stride; // stride of one element along this dimension in storage
                                          // e.g.     32, 8, 1
-        vector<T> m_data;                // m_data.size() = 256
+        size_t m_len;                    // m_len = 256
+        T *m_ptr;                        // storage, m_data or external memory of a view
+        vector<T, Alloc> m_data;         // owned storage, empty for a view
 
         // initialize member data and allocate array data.
+        // A view is turned back into an array with its own storage.
         void init (size_t dim, size_t const *size) {
             m_dim = dim;
             size_t len = 1;
@@ -42,10 +142,62 @@ namespace argos {
                 m_stride[i] = len;
                 len *= size[i];
             }
+            if (isView()) {
+                m_data.clear();
+            }
             m_data.resize(len);
+            m_len = len;
+            m_ptr = m_data.empty() ? nullptr : &m_data[0];
         }
     public:
-        Array (): m_dim(0) {
+        Array (): m_dim(0), m_len(0), m_ptr(nullptr) {
+        }
+
+        // copy always gets its own storage, even if a is a view.
+        Array (Array const &a)
+            : m_dim(a.m_dim), m_size(a.m_size), m_stride(a.m_stride), m_len(a.m_len),
+            m_data(a.m_ptr, a.m_ptr + a.m_len) {
+            m_ptr = m_data.empty() ? nullptr : &m_data[0];
+        }
+
+        Array &operator = (Array const &a) {
+            if (this != &a) {
+                m_dim = a.m_dim;
+                m_size = a.m_size;
+                m_stride = a.m_stride;
+                m_len = a.m_len;
+                m_data.assign(a.m_ptr, a.m_ptr + a.m_len);
+                m_ptr = m_data.empty() ? nullptr : &m_data[0];
+            }
+            return *this;
+        }
+
+        // Make the array a view of external storage of size(), which must
+        // outlive the view.  Content is not preserved.
+        void bind (T *ptr) {
+            vector<T, Alloc>().swap(m_data);
+            m_ptr = ptr;
+        }
+
+        // Switch a view back to its own storage.  Content is not preserved.
+        void unbind () {
+            if (isView()) {
+                m_data.resize(m_len);
+                m_ptr = m_data.empty() ? nullptr : &m_data[0];
+            }
+        }
+
+        bool isView () const {
+            return m_data.size() != m_len;
+        }
+
+        void swap (Array &a) {
+            std::swap(m_dim, a.m_dim);
+            std::swap(m_size, a.m_size);
+            std::swap(m_stride, a.m_stride);
+            std::swap(m_len, a.m_len);
+            std::swap(m_ptr, a.m_ptr);
+            m_data.swap(a.m_data);
         }
 
         void display ()
@@ -56,6 +208,8 @@ namespace argos {
 
         void clear () {
             m_dim = 0;
+            m_len = 0;
+            m_ptr = nullptr;
             m_data.clear();
         }
 
@@ -82,19 +236,19 @@ namespace argos {
 
 
         value_type *at (size_t d1) {
-            return &m_data[d1 * m_stride[0]];
+            return m_ptr + d1 * m_stride[0];
         }
 
         value_type const *at (size_t d1) const {
-            return &m_data[d1 * m_stride[0]];
+            return m_ptr + d1 * m_stride[0];
         }
 
         value_type *at (size_t d1, size_t d2) {
-            return &m_data[d1 * m_stride[0] + d2 * m_stride[1]];
+            return m_ptr + d1 * m_stride[0] + d2 * m_stride[1];
         }
 
         value_type const *at (size_t d1, size_t d2) const {
-            return &m_data[d1 * m_stride[0] + d2 * m_stride[1]];
+            return m_ptr + d1 * m_stride[0] + d2 * m_stride[1];
         }
         // access element by coordinate
         /*
@@ -148,11 +302,11 @@ namespace argos {
         }
 
         value_type const *addr () const {
-            return &m_data[0];
+            return m_ptr;
         }
 
         value_type *addr () {
-            return &m_data[0];
+            return m_ptr;
         }
 
         size_t dim () const {
@@ -160,11 +314,7 @@ namespace argos {
         }
 
         double l2 () const {
-            double s = 0;
-            for (auto const &v: m_data) {
-                s += v * v;
-            }
-            return std::sqrt(s);
+            return std::sqrt(simd::sumsq(m_ptr, m_len));
         }
 
         void size (vector<size_t> *sz) const {
@@ -177,77 +327,61 @@ namespace argos {
         }
 
         size_t size () const {
-            return m_data.size();
+            return m_len;
         }
 
-        void sync (Array<T> const &from) {
+        void sync (Array const &from) {
             BOOST_VERIFY(from.size() == size());
-            copy(from.m_data.begin(), from.m_data.end(), m_data.begin());
+            copy(from.m_ptr, from.m_ptr + from.m_len, m_ptr);
         }
 
         pair<T *, T *> range () {
-            return make_pair(&m_data[0], &m_data[0] + m_data.size());
+            return make_pair(m_ptr, m_ptr + m_len);
         }
 
         // arithmetics
         void fill (T const &v) {
-            std::fill(m_data.begin(), m_data.end(), v);
+            std::fill(m_ptr, m_ptr + m_len, v);
         }
 
+        // The kernels are in simd.h.
         void scale (T const &v) {
-            for (T &a: m_data) {
-                a *= v;
-            }
+            simd::scale(m_ptr, v, m_len);
         }
 
-        void add (Array<T> const &b) {
+        void add (Array const &b) {
             BOOST_VERIFY(size() == b.size());
-            for (size_t i = 0; i < m_data.size(); ++i) {
-                m_data[i] += b.m_data[i];
-            }
+            simd::add(m_ptr, b.m_ptr, m_len);
         }
 
-        void add_diff (Array<T> const &a, Array<T> const &b) {
+        void add_diff (Array const &a, Array const &b) {
             BOOST_VERIFY(a.size() == size());
             BOOST_VERIFY(b.size() == size());
-            for (size_t i = 0; i < m_data.size(); ++i) {
-                m_data[i] += a.m_data[i] - b.m_data[i];
-            }
+            simd::add_diff(m_ptr, a.m_ptr, b.m_ptr, m_len);
         }
 
-        void add_scaled (T const &a, Array<T> const &b) {
+        void add_scaled (T const &a, Array const &b) {
             BOOST_VERIFY(size() == b.size());
-            for (size_t i = 0; i < m_data.size(); ++i) {
-                m_data[i] += a * b.m_data[i];
-            }
+            simd::axpy(m_ptr, a, b.m_ptr, m_len);
         }
 
-        void add_scaled_wrapping (T const &scale, Array<T> const &a) {
-            BOOST_VERIFY(a.m_data.size() % m_data.size() == 0);
-            for (size_t i = 0; i < a.m_data.size(); i += m_data.size()) {
-                /*
-                for (size_t j = 0; j < 
-                std::copy(a.m_data.begin(), a.m_data.end(), &m_data[i]);
-                */
-                for (size_t j = 0; j < m_data.size(); ++j) {
-                    m_data[j] += scale * a.m_data[i + j];
-                }
+        // Adds scale times each m_len-long row of a.
+        void add_scaled_wrapping (T const &scale, Array const &a) {
+            BOOST_VERIFY(a.m_len % m_len == 0);
+            for (size_t i = 0; i < a.m_len; i += m_len) {
+                simd::axpy(m_ptr, scale, a.m_ptr + i, m_len);
             }
         }
 
-        T l2sqr (Array<T> const &a) const {
-            T r = 0;
-            for (size_t i = 0; i < m_data.size(); ++i) {
-                T v = m_data[i] - a.m_data[i];
-                r += v * v;
-            }
-            return r;
+        T l2sqr (Array const &a) const {
+            BOOST_VERIFY(a.size() == size());
+            return T(simd::l2sqr(m_ptr, a.m_ptr, m_len));
         }
 
-        void tile (Array<T> const &a) {
-            BOOST_VERIFY(m_data.size() % a.m_data.size() == 0);
-            for (size_t i = 0; i < m_data.size(); i += a.m_data.size()) {
-                std::copy(a.m_data.begin(), a.m_data.end(), &m_data[i]);
+        void tile (Array const &a) {
+            BOOST_VERIFY(m_len % a.m_len == 0);
+            for (size_t i = 0; i < m_len; i += a.m_len) {
+                std::copy(a.m_ptr, a.m_ptr + a.m_len, m_ptr + i);
             }
         }
 
@@ -255,7 +389,7 @@ namespace argos {
         void apply (OP const &op) {
             T *y = addr();
             size_t sz = size();
-#pragma omp parallel for
+#pragma omp parallel for schedule(static) num_threads(parallel::threads(sz))
             for (size_t i = 0; i < sz; ++i) {
                 op(y[i]);
             }
@@ -272,41 +406,133 @@ namespace argos {
         }
 
         template <typename OP>
-        void apply (Array<T> const &ax, OP const &op) {
+        void apply (Array const &ax, OP const &op) {
             T const *x = ax.addr();
             T *y = addr();
             size_t sz = size();
-#pragma omp parallel for
+#pragma omp parallel for schedule(static) num_threads(parallel::threads(sz))
             for (size_t i = 0; i < sz; ++i) {
                 op(y[i], x[i]);
             }
         }
 
         template <typename OP>
-        void apply (Array<T> const &ax1, Array<T> const &ax2, OP const &op) {
+        void apply (Array const &ax1, Array const &ax2, OP const &op) {
             T const *x1 = ax1.addr();
             T const *x2 = ax2.addr();
             T *y = addr();
             size_t sz = size();
-#pragma omp parallel for
+#pragma omp parallel for schedule(static) num_threads(parallel::threads(sz))
             for (size_t i = 0; i < sz; ++i) {
                 op(y[i], x1[i], x2[i]);
             }
         }
 
         template <typename OP>
-        void apply (Array<T> const &ax1, Array<T> const &ax2, Array<T> const &ax3, OP const &op) {
+        void apply (Array const &ax1, Array const &ax2, Array const &ax3, OP const &op) {
             T const *x1 = ax1.addr();
             T const *x2 = ax2.addr();
             T const *x3 = ax3.addr();
             T *y = addr();
             size_t sz = size();
-#pragma omp parallel for
+#pragma omp parallel for schedule(static) num_threads(parallel::threads(sz))
             for (size_t i = 0; i < sz; ++i) {
                 op(y[i], x1[i], x2[i], x3[i]);
             }
         }
     };
+
+    // Sparse matrix in compressed sparse row (CSR) format.
+    // Row i has non-zeros [offsets()[i], offsets()[i+1]) of indices()
+    // (column numbers) and values().
+    template <typename T = real_t>
+    class SparseArray {
+    public:
+        typedef T value_type;
+    private:
+        size_t m_cols;
+        vector<size_t> m_offsets;        // rows() + 1 entries
+        vector<unsigned> m_indices;
+        vector<T> m_values;
+    public:
+        SparseArray (size_t cols = 0): m_cols(cols), m_offsets(1, 0) {
+        }
+
+        void clear () {
+            m_offsets.assign(1, 0);
+            m_indices.clear();
+            m_values.clear();
+        }
+
+        size_t rows () const {
+            return m_offsets.size() - 1;
+        }
+
+        size_t cols () const {
+            return m_cols;
+        }
+
+        void setCols (size_t cols) {
+            m_cols = cols;
+        }
+
+        // number of non-zeros
+        size_t nnz () const {
+            return m_indices.size();
+        }
+
+        // append a non-zero to the last row
+        void push (unsigned col, T const &v) {
+            m_indices.push_back(col);
+            m_values.push_back(v);
+        }
+
+        // close the last row, push() adds to a new row afterwards
+        void endRow () {
+            m_offsets.push_back(m_indices.size());
+        }
+
+        // append all rows of a
+        void append (SparseArray<T> const &a) {
+            size_t base = m_indices.size();
+            for (size_t i = 1; i < a.m_offsets.size(); ++i) {
+                m_offsets.push_back(base + a.m_offsets[i]);
+            }
+            m_indices.insert(m_indices.end(), a.m_indices.begin(), a.m_indices.end());
+            m_values.insert(m_values.end(), a.m_values.begin(), a.m_values.end());
+        }
+
+        // append row i of a
+        void appendRow (SparseArray<T> const &a, size_t i) {
+            size_t b = a.m_offsets[i], e = a.m_offsets[i + 1];
+            m_indices.insert(m_indices.end(), a.m_indices.begin() + b, a.m_indices.begin() + e);
+            m_values.insert(m_values.end(), a.m_values.begin() + b, a.m_values.begin() + e);
+            endRow();
+        }
+
+        void swap (SparseArray<T> &a) {
+            std::swap(m_cols, a.m_cols);
+            m_offsets.swap(a.m_offsets);
+            m_indices.swap(a.m_indices);
+            m_values.swap(a.m_values);
+        }
+
+        vector<size_t> const &offsets () const { return m_offsets; }
+        vector<unsigned> const &indices () const { return m_indices; }
+        vector<T> const &values () const { return m_values; }
+
+        // direct access for bulk loading, offsets must stay consistent
+        vector<size_t> &offsets () { return m_offsets; }
+        vector<unsigned> &indices () { return m_indices; }
+        vector<T> &values () { return m_values; }
+
+        // scatter row i into dense x of cols() entries
+        void expand (size_t i, T *x) const {
+            for (size_t k = m_offsets[i]; k < m_offsets[i + 1]; ++k) {
+                x[m_indices[k]] = m_values[k];
+            }
+        }
+    };
 }
 
 #endif
@@ -0,0 +1,678 @@
+#ifndef ARGOS_IO
+#define ARGOS_IO
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <stdexcept>
+#include <limits>
+#include <cstdlib>
+#include <cstdio>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "array.h"
+
+namespace argos {
+    namespace io {
+
+        using std::string;
+        using std::vector;
+        using std::runtime_error;
+
+        /// Read-only memory-mapped file.
+        class MappedFile {
+            char const *m_data;
+            size_t m_size;
+
+            MappedFile (MappedFile const &) = delete;
+            MappedFile &operator = (MappedFile const &) = delete;
+        public:
+            MappedFile (): m_data(nullptr), m_size(0) {
+            }
+
+            explicit MappedFile (string const &path): m_data(nullptr), m_size(0) {
+                open(path);
+            }
+
+            ~MappedFile () {
+                close();
+            }
+
+            void open (string const &path) {
+                close();
+                int fd = ::open(path.c_str(), O_RDONLY);
+                if (fd < 0) throw runtime_error("cannot open " + path);
+                struct stat st;
+                if (fstat(fd, &st) != 0) {
+                    ::close(fd);
+                    throw runtime_error("cannot stat " + path);
+                }
+                m_size = st.st_size;
+                if (m_size > 0) {
+                    void *ptr = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+                    if (ptr == MAP_FAILED) {
+                        ::close(fd);
+                        m_size = 0;
+                        throw runtime_error("cannot map " + path);
+                    }
+                    m_data = static_cast<char const *>(ptr);
+                }
+                ::close(fd);
+            }
+
+            void close () {
+                if (m_data) {
+                    munmap(const_cast<char *>(m_data), m_size);
+                }
+                m_data = nullptr;
+                m_size = 0;
+            }
+
+            char const *data () const {
+                return m_data;
+            }
+
+            size_t size () const {
+                return m_size;
+            }
+        };
+
+        /// Element types of packed datasets.
+        enum PackedType {
+            PACKED_UINT8 = 0,   // mapped to [-1, 1] when loaded
+            PACKED_FLOAT32 = 1
+        };
+
+        /// Header of a packed dataset file.
+        /**
+         * The file is the header, followed by the examples stored back to
+         * back (starting at data_offset, 64-byte aligned), followed by the
+         * labels (int32, "labels" of them per example, at label_offset).
+         * Multi-channel images are stored as height x width x channels,
+         * which is the layout of image nodes, so an example can be copied
+         * into a batch without reordering.
+         */
+        struct PackedHeader {
+            static constexpr unsigned MAX_RANK = 4;
+            static constexpr unsigned VERSION = 1;
+            char magic[8];              // "ARGOSPAK"
+            uint32_t version;
+            uint32_t dtype;             // PackedType
+            uint64_t count;             // number of examples
+            uint32_t labels;            // labels per example
+            uint32_t rank;              // dimensions of one example
+            uint64_t shape[MAX_RANK];
+            uint64_t data_offset;
+            uint64_t label_offset;
+
+            size_t dim () const {
+                size_t d = 1;
+                for (unsigned i = 0; i < rank; ++i) d *= shape[i];
+                return d;
+            }
+
+            size_t typeSize () const {
+                return dtype == PACKED_FLOAT32 ? 4 : 1;
+            }
+        };
+
+        static char const PACKED_MAGIC[8] = {'A', 'R', 'G', 'O', 'S', 'P', 'A', 'K'};
+        static_assert(sizeof(PackedHeader) == 80, "packed header layout");
+
+        /// Packed dataset, memory-mapped.
+        /**
+         * Loading is just an mmap; the pages are brought in by the OS as
+         * examples are accessed, and shared by processes reading the
+         * same file.
+         */
+        class PackedDataSet {
+            MappedFile m_file;
+            PackedHeader m_header;
+            char const *m_data;
+            int32_t const *m_labels;
+            size_t m_stride;            // bytes per example
+        public:
+            PackedDataSet (): m_data(nullptr), m_labels(nullptr), m_stride(0) {
+                memset(&m_header, 0, sizeof(m_header));
+            }
+
+            /// Whether the file at path is a packed dataset.
+            static bool detect (string const &path) {
+                std::ifstream is(path.c_str(), std::ios::binary);
+                char magic[sizeof(PACKED_MAGIC)];
+                if (!is.read(magic, sizeof(magic))) return false;
+                return memcmp(magic, PACKED_MAGIC, sizeof(magic)) == 0;
+            }
+
+            void load (string const &path) {
+                m_file.open(path);
+                if (m_file.size() < sizeof(PackedHeader)
+                        || memcmp(m_file.data(), PACKED_MAGIC, sizeof(PACKED_MAGIC)) != 0) {
+                    throw runtime_error(path + " is not a packed dataset");
+                }
+                memcpy(&m_header, m_file.data(), sizeof(m_header));
+                if (m_header.version != PackedHeader::VERSION) {
+                    throw runtime_error(path + ": unsupported packed dataset version");
+                }
+                if (m_header.rank > PackedHeader::MAX_RANK
+                        || (m_header.dtype != PACKED_UINT8 && m_header.dtype != PACKED_FLOAT32)) {
+                    throw runtime_error(path + ": corrupted packed dataset header");
+                }
+                m_stride = m_header.dim() * m_header.typeSize();
+                if (m_header.data_offset + m_header.count * m_stride > m_file.size()
+                        || m_header.label_offset + m_header.count * m_header.labels * sizeof(int32_t) > m_file.size()) {
+                    throw runtime_error(path + ": packed dataset truncated");
+                }
+                m_data = m_file.data() + m_header.data_offset;
+                m_labels = reinterpret_cast<int32_t const *>(m_file.data() + m_header.label_offset);
+            }
+
+            PackedHeader const &header () const {
+                return m_header;
+            }
+
+            size_t size () const {
+                return m_header.count;
+            }
+
+            /// Shape of one example.
+            vector<size_t> shape () const {
+                return vector<size_t>(m_header.shape, m_header.shape + m_header.rank);
+            }
+
+            /// Raw bytes of example i.
+            char const *example (size_t i) const {
+                return m_data + i * m_stride;
+            }
+
+            int label (size_t i, unsigned j = 0) const {
+                return m_labels[i * m_header.labels + j];
+            }
+        };
+
+        /// Write a packed dataset, one example at a time.
+        /**
+         * The header is only written by close().  A writer destroyed
+         * without close(), e.g. by an exception while packing, removes its
+         * partial file instead of leaving one that looks complete.
+         */
+        class PackedWriter {
+            string m_path;
+            std::ofstream m_os;
+            PackedHeader m_header;
+            size_t m_stride;
+            vector<int32_t> m_labels;
+        public:
+            PackedWriter (string const &path, PackedType dtype, vector<size_t> const &shape, unsigned labels)
+                : m_path(path), m_os(path.c_str(), std::ios::binary)
+            {
+                if (!m_os) throw runtime_error("cannot create " + path);
+                if (shape.size() > PackedHeader::MAX_RANK) throw runtime_error("too many dimensions");
+                memset(&m_header, 0, sizeof(m_header));
+                memcpy(m_header.magic, PACKED_MAGIC, sizeof(PACKED_MAGIC));
+                m_header.version = PackedHeader::VERSION;
+                m_header.dtype = dtype;
+                m_header.labels = labels;
+                m_header.rank = shape.size();
+                std::copy(shape.begin(), shape.end(), m_header.shape);
+                m_header.data_offset = (sizeof(PackedHeader) + 63) / 64 * 64;
+                m_stride = m_header.dim() * m_header.typeSize();
+                vector<char> pad(m_header.data_offset, 0);
+                m_os.write(&pad[0], pad.size());
+            }
+
+            ~PackedWriter () {
+                if (m_os.is_open()) {
+                    m_os.close();
+                    std::remove(m_path.c_str());
+                }
+            }
+
+            /// Append one example, data has the layout given by shape.
+            void add (void const *data, int32_t const *labels) {
+                m_os.write(static_cast<char const *>(data), m_stride);
+                m_labels.insert(m_labels.end(), labels, labels + m_header.labels);
+                ++m_header.count;
+            }
+
+            size_t size () const {
+                return m_header.count;
+            }
+
+            void close () {
+                m_header.label_offset = m_header.data_offset + m_header.count * m_stride;
+                if (m_labels.size()) {
+                    m_os.write(reinterpret_cast<char const *>(&m_labels[0]), m_labels.size() * sizeof(int32_t));
+                }
+                m_os.seekp(0);
+                m_os.write(reinterpret_cast<char const *>(&m_header), sizeof(m_header));
+                m_os.close();
+                if (!m_os) {
+                    std::remove(m_path.c_str());
+                    throw runtime_error("failed to write packed dataset " + m_path);
+                }
+            }
+        };
+
+        /// Convert 8-bit values to [-1, 1].
+        /**
+         * Done with a lookup table, which is cheaper than the arithmetic
+         * and gives the same values as the single precision conversion
+         * the CIFAR loader has always used.
+         */
+        template <typename T>
+        void unpack (uint8_t const *from, size_t n, T *to) {
+            struct Table {
+                T value[256];
+                Table () {
+                    for (unsigned v = 0; v < 256; ++v) {
+                        value[v] = T(float(float(v) * 2 / 255.0 - 1));
+                    }
+                }
+            };
+            static Table const table;
+            for (size_t i = 0; i < n; ++i) {
+                to[i] = table.value[from[i]];
+            }
+        }
+
+        /// Copy an example of a packed dataset to T, converting as needed.
+        template <typename T>
+        void unpack (PackedHeader const &header, char const *from, T *to) {
+            size_t n = header.dim();
+            if (header.dtype == PACKED_UINT8) {
+                unpack(reinterpret_cast<uint8_t const *>(from), n, to);
+            }
+            else {
+                float const *f = reinterpret_cast<float const *>(from);
+                std::copy(f, f + n, to);
+            }
+        }
+
+        /// Number parsing from a memory buffer.
+        /**
+         * Text in a mapped file is not NUL-terminated, so strtod and
+         * friends can't be used directly.  Each function parses a number
+         * starting at p and returns the position after it, or nullptr if
+         * there is no number at p.
+         */
+        namespace parse {
+
+            inline bool space (char c) {
+                return c == ' ' || c == '\t' || c == '\r';
+            }
+
+            inline bool digit (char c) {
+                return c >= '0' && c <= '9';
+            }
+
+            inline char const *number (char const *p, char const *end, unsigned *v) {
+                if (p < end && *p == '+') ++p;
+                if (p >= end || !digit(*p)) return nullptr;
+                uint64_t x = 0;
+                while (p < end && digit(*p)) {
+                    x = x * 10 + (*p - '0');
+                    if (x > std::numeric_limits<unsigned>::max()) return nullptr;
+                    ++p;
+                }
+                *v = unsigned(x);
+                return p;
+            }
+
+            inline char const *number (char const *p, char const *end, int *v) {
+                bool neg = false;
+                if (p < end && (*p == '-' || *p == '+')) {
+                    neg = *p == '-';
+                    ++p;
+                }
+                if (p >= end || !digit(*p)) return nullptr;
+                int64_t x = 0;
+                while (p < end && digit(*p)) {
+                    x = x * 10 + (*p - '0');
+                    if (x > int64_t(std::numeric_limits<int>::max()) + 1) return nullptr;
+                    ++p;
+                }
+                if (neg) x = -x;
+                if (x > std::numeric_limits<int>::max()) return nullptr;
+                *v = int(x);
+                return p;
+            }
+
+            /// Parse a floating-point number.
+            /**
+             * The common case, up to 19 significant digits with a small
+             * decimal exponent, is done with a single multiplication or
+             * division of two exactly represented values, which is correctly
+             * rounded and so gives the same result as strtod.  Anything else
+             * (long mantissas, large exponents, inf, nan) is copied out and
+             * passed to strtod.
+             */
+            inline char const *number (char const *p, char const *end, double *v) {
+                static double const pow10[] = {
+                    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+                    1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20,
+                    1e21, 1e22
+                };
+                char const *begin = p;
+                bool neg = false;
+                if (p < end && (*p == '-' || *p == '+')) {
+                    neg = *p == '-';
+                    ++p;
+                }
+                uint64_t m = 0;
+                int digits = 0;     // significant digits in m
+                int exp = 0;
+                bool any = false;
+                bool exact = true;
+                while (p < end && digit(*p)) {
+                    any = true;
+                    if (digits < 19) {
+                        m = m * 10 + (*p - '0');
+                        if (m) ++digits;
+                    }
+                    else {
+                        exact = false;
+                    }
+                    ++p;
+                }
+                if (p < end && *p == '.') {
+                    ++p;
+                    while (p < end && digit(*p)) {
+                        any = true;
+                        if (digits < 19) {
+                            m = m * 10 + (*p - '0');
+                            if (m) ++digits;
+                            --exp;
+                        }
+                        else {
+                            exact = false;
+                        }
+                        ++p;
+                    }
+                }
+                if (any && p < end && (*p == 'e' || *p == 'E')) {
+                    char const *q = p + 1;
+                    bool eneg = false;
+                    if (q < end && (*q == '-' || *q == '+')) {
+                        eneg = *q == '-';
+                        ++q;
+                    }
+                    if (q < end && digit(*q)) {
+                        int e = 0;
+                        while (q < end && digit(*q)) {
+                            if (e < 100000) e = e * 10 + (*q - '0');
+                            ++q;
+                        }
+                        exp += eneg ? -e : e;
+                        p = q;
+                    }
+                }
+                if (any && exact && m <= (uint64_t(1) << 53) && exp >= -22 && exp <= 22) {
+                    double x = double(m);
+                    x = (exp < 0) ? x / pow10[-exp] : x * pow10[exp];
+                    *v = neg ? -x : x;
+                    return p;
+                }
+                char const *q = begin;
+                while (q < end && !space(*q) && *q != '\n') ++q;
+                string buf(begin, q);
+                char *stop;
+                double x = strtod(buf.c_str(), &stop);
+                if (stop == buf.c_str()) return nullptr;
+                *v = x;
+                return begin + (stop - buf.c_str());
+            }
+        }
+
+        /// Dataset in libsvm format, "label index:value ...", 1-based indices.
+        /**
+         * Rows are kept in a single CSR array.  The text is memory-mapped,
+         * cut into chunks at line boundaries and the chunks are parsed in
+         * parallel.  The result can be saved to a binary cache file, which
+         * is used by later loads as long as the size and modification time
+         * of the text file are unchanged.
+         */
+        template <typename L>
+        class LibSvmDataSet {
+            struct CacheHeader {
+                char magic[8];          // "ARGOSSVM"
+                uint32_t version;
+                uint32_t label_size;
+                uint32_t value_size;
+                uint32_t reserved;
+                uint64_t source_size;
+                int64_t source_mtime;
+                int64_t source_mtime_nsec;
+                uint64_t rows;
+                uint64_t nnz;
+                uint64_t cols;
+            };
+            static constexpr unsigned CACHE_VERSION = 1;
+            static constexpr size_t CHUNK = 4 * 1024 * 1024;
+            // malformed lines quoted in the error of parse
+            static constexpr size_t MAX_ERRORS = 10;
+
+            vector<L> m_labels;
+            SparseArray<> m_rows;
+
+            CacheHeader cacheHeader (string const &path, size_t dim) const {
+                struct stat st;
+                if (stat(path.c_str(), &st) != 0) throw runtime_error("cannot stat " + path);
+                CacheHeader h;
+                memset(&h, 0, sizeof(h));
+                memcpy(h.magic, "ARGOSSVM", 8);
+                h.version = CACHE_VERSION;
+                h.label_size = sizeof(L);
+                h.value_size = sizeof(SparseArray<>::value_type);
+                h.source_size = st.st_size;
+                h.source_mtime = st.st_mtim.tv_sec;
+                h.source_mtime_nsec = st.st_mtim.tv_nsec;
+                h.cols = dim;
+                return h;
+            }
+
+            template <typename T>
+            static char const *read (char const *p, vector<T> *v, size_t n) {
+                v->resize(n);
+                if (n) memcpy(&v->at(0), p, n * sizeof(T));
+                return p + n * sizeof(T);
+            }
+
+            template <typename T>
+            static void write (std::ostream &os, vector<T> const &v) {
+                if (v.size()) os.write(reinterpret_cast<char const *>(&v[0]), v.size() * sizeof(T));
+            }
+
+            bool loadCache (string const &cache, CacheHeader h) {
+                if (access(cache.c_str(), R_OK) != 0) return false;
+                MappedFile file(cache);
+                CacheHeader const *c = reinterpret_cast<CacheHeader const *>(file.data());
+                if (file.size() < sizeof(CacheHeader)) return false;
+                h.rows = c->rows;
+                h.nnz = c->nnz;
+                if (memcmp(&h, c, sizeof(h)) != 0) return false;
+                size_t total = sizeof(h) + h.rows * sizeof(L) + (h.rows + 1) * sizeof(size_t)
+                             + h.nnz * (sizeof(unsigned) + sizeof(SparseArray<>::value_type));
+                if (file.size() != total) return false;
+                char const *p = file.data() + sizeof(h);
+                p = read(p, &m_labels, h.rows);
+                p = read(p, &m_rows.offsets(), h.rows + 1);
+                p = read(p, &m_rows.indices(), h.nnz);
+                p = read(p, &m_rows.values(), h.nnz);
+                return true;
+            }
+
+            void saveCache (string const &cache, CacheHeader h) const {
+                h.rows = m_labels.size();
+                h.nnz = m_rows.nnz();
+                string tmp = cache + ".tmp." + std::to_string(getpid());
+                {
+                    std::ofstream os(tmp.c_str(), std::ios::binary);
+                    os.write(reinterpret_cast<char const *>(&h), sizeof(h));
+                    write(os, m_labels);
+                    write(os, m_rows.offsets());
+                    write(os, m_rows.indices());
+                    write(os, m_rows.values());
+                    if (!os) {
+                        unlink(tmp.c_str());
+                        throw runtime_error("cannot write " + tmp);
+                    }
+                }
+                if (rename(tmp.c_str(), cache.c_str()) != 0) {
+                    unlink(tmp.c_str());
+                    throw runtime_error("cannot write " + cache);
+                }
+            }
+
+            // parse lines in [p, end), end is a line end or the end of file;
+            // malformed lines are counted in bad, the first MAX_ERRORS of
+            // them quoted in errors
+            static void parseChunk (char const *p, char const *end, size_t dim,
+                                    vector<L> *labels, SparseArray<> *rows,
+                                    vector<string> *errors, size_t *bad) {
+                while (p < end) {
+                    char const *eol = static_cast<char const *>(memchr(p, '\n', end - p));
+                    if (!eol) eol = end;
+                    char const *line = p;
+                    auto fail = [&](string const &what) {
+                        ++*bad;
+                        if (errors->size() < MAX_ERRORS) errors->push_back(what + ": " + string(line, eol));
+                    };
+                    while (p < eol && parse::space(*p)) ++p;
+                    L label;
+                    char const *q = parse::number(p, eol, &label);
+                    if (q) {
+                        labels->push_back(label);
+                        p = q;
+                        for (;;) {
+                            while (p < eol && parse::space(*p)) ++p;
+                            if (p >= eol) break;
+                            unsigned d;
+                            double v;
+                            if (!(q = parse::number(p, eol, &d))) {
+                                fail("bad index");
+                                break;
+                            }
+                            p = q;
+                            while (p < eol && parse::space(*p)) ++p;
+                            if (p >= eol || *p != ':') {
+                                fail("missing ':'");
+                                break;
+                            }
+                            ++p;
+                            while (p < eol && parse::space(*p)) ++p;
+                            if (!(q = parse::number(p, eol, &v))) {
+                                fail("bad value");
+                                break;
+                            }
+                            p = q;
+                            if (d < 1 || d > dim) {
+                                fail("index out of range " + std::to_string(d));
+                                break;
+                            }
+                            rows->push(d - 1, v);
+                        }
+                        rows->endRow();
+                    }
+                    else if (p < eol) {
+                        fail("bad label");
+                    }
+                    p = eol + 1;
+                }
+            }
+
+            void parse (string const &path, size_t dim) {
+                MappedFile file(path);
+                char const *begin = file.data();
+                char const *end = begin + file.size();
+                // chunk boundaries, each after a line end
+                vector<char const *> cuts{begin};
+                for (size_t off = CHUNK; off < file.size(); off += CHUNK) {
+                    char const *from = std::max(begin + off, cuts.back());
+                    char const *c = static_cast<char const *>(memchr(from, '\n', end - from));
+                    if (!c) break;
+                    cuts.push_back(c + 1);
+                }
+                cuts.push_back(end);
+                size_t n = cuts.size() - 1;
+                vector<vector<L>> labels(n);
+                vector<SparseArray<>> rows(n);
+                vector<vector<string>> errors(n);
+                vector<size_t> bad(n, 0);
+#pragma omp parallel for schedule(dynamic)
+                for (size_t i = 0; i < n; ++i) {
+                    parseChunk(cuts[i], cuts[i + 1], dim, &labels[i], &rows[i], &errors[i], &bad[i]);
+                }
+                size_t nbad = 0, quoted = 0;
+                string msg;
+                for (size_t i = 0; i < n; ++i) {
+                    nbad += bad[i];
+                    for (string const &e: errors[i]) {
+                        if (quoted >= MAX_ERRORS) break;
+                        msg += "\n  " + e;
+                        ++quoted;
+                    }
+                }
+                if (nbad) {
+                    if (nbad > quoted) msg += "\n  ...";
+                    throw runtime_error(path + ": " + std::to_string(nbad) + " bad libsvm lines:" + msg);
+                }
+                size_t total = 0, nnz = 0;
+                for (size_t i = 0; i < n; ++i) {
+                    total += labels[i].size();
+                    nnz += rows[i].nnz();
+                }
+                m_labels.clear();
+                m_labels.reserve(total);
+                m_rows.clear();
+                m_rows.offsets().reserve(total + 1);
+                m_rows.indices().reserve(nnz);
+                m_rows.values().reserve(nnz);
+                for (size_t i = 0; i < n; ++i) {
+                    m_labels.insert(m_labels.end(), labels[i].begin(), labels[i].end());
+                    m_rows.append(rows[i]);
+                    vector<L>().swap(labels[i]);
+                    SparseArray<>().swap(rows[i]);
+                }
+            }
+        public:
+            /// Load path, using cache as binary cache if not empty.
+            void load (string const &path, size_t dim, string const &cache = string()) {
+                m_labels.clear();
+                m_rows.clear();
+                m_rows.setCols(dim);
+                if (cache.size()) {
+                    CacheHeader h = cacheHeader(path, dim);
+                    if (loadCache(cache, h)) return;
+                    parse(path, dim);
+                    try {
+                        saveCache(cache, h);
+                    }
+                    catch (runtime_error const &) {
+                        // caching is best effort, e.g. read-only directory
+                    }
+                    return;
+                }
+                parse(path, dim);
+            }
+
+            size_t size () const {
+                return m_labels.size();
+            }
+
+            vector<L> const &labels () const {
+                return m_labels;
+            }
+
+            SparseArray<> const &rows () const {
+                return m_rows;
+            }
+        };
+    }
+}
+
+#endif
@@ -1,62 +1,130 @@
 #ifndef ARGOS_NODE_CIFAR
 #define ARGOS_NODE_CIFAR
 
+#include "io.h"
+
 namespace argos {
     namespace cifar {
 
-        struct Example {
-            int label;
-            int labelx;
-            vector<float> data;
-        };
-
         static size_t constexpr WIDTH = 32;
         static size_t constexpr HEIGHT = 32;
         static size_t constexpr AREA = WIDTH * HEIGHT;
         static size_t constexpr CHANNELS = 3;
         static size_t constexpr DIM = WIDTH * HEIGHT * CHANNELS;
 
-        class DataSet: public vector<Example> {
-        public:
-            void load (string const &path, bool big = false, int cat = 0) {
+        /// CIFAR images, kept as 8-bit pixels in height x width x channels.
+        /**
+         * A packed dataset (see io.h and the pack tool) is memory-mapped as
+         * is; a file in the original CIFAR binary format is read and
+         * reordered in memory.  Pixels are converted to [-1, 1] only when
+         * a batch is loaded.
+         */
+        class DataSet {
+            io::PackedDataSet m_packed;
+            vector<uint8_t> m_pixels;       // original format only
+            vector<int> m_labels;           // original format only
+            vector<unsigned> m_index;       // packed, when filtered by category
+            size_t m_size;
+            bool m_is_packed;
+
+            void loadPacked (string const &path, int cat) {
+                m_packed.load(path);
+                io::PackedHeader const &h = m_packed.header();
+                if (h.dtype != io::PACKED_UINT8 || h.labels < 1
+                        || m_packed.shape() != vector<size_t>{HEIGHT, WIDTH, CHANNELS}) {
+                    throw runtime_error(path + " is not a packed CIFAR dataset");
+                }
+                m_is_packed = true;
+                m_size = m_packed.size();
+                if (cat > 0) {
+                    for (unsigned i = 0; i < m_packed.size(); ++i) {
+                        if (m_packed.label(i) < cat) m_index.push_back(i);
+                    }
+                    m_size = m_index.size();
+                }
+            }
+
+            void loadOriginal (string const &path, bool big, int cat) {
                 ifstream is(path.c_str(), ios::binary);
-                size_t sz = big ? 2 : 1 + DIM;
+                size_t sz = (big ? 2 : 1) + DIM;
                 is.seekg(0, ios::end);
                 size_t total = is.tellg();
                 is.seekg(0, ios::beg);
                 BOOST_VERIFY(total % sz == 0);
-                resize(total / sz);
                 vector<uint8_t> bytes(sz);
-                unsigned n = 0;
-                for (unsigned i = 0; i < size(); ++i) {
-                    Example &e = at(n);
+                m_pixels.resize(total / sz * DIM);
+                m_size = 0;
+                for (unsigned i = 0; i < total / sz; ++i) {
                     uint8_t *p = &bytes[0];
                     is.read((char *)p, sz);
-                    e.label = int(p[0]); ++p;
-                    e.labelx = 0;
-                    if (big) {
-                        e.labelx = int(p[0]);
-                        ++p;
-                    }
-                    e.data.resize(DIM);
+                    int label = int(p[0]);
+                    p += big ? 2 : 1;
+                    if ((cat > 0) && (label >= cat)) continue;
+                    m_labels.push_back(label);
+                    uint8_t *x = &m_pixels[m_size * DIM];
                     for (unsigned j = 0; j < CHANNELS; ++j) {
                         for (unsigned k = 0; k < AREA; ++k) {
-                            e.data[k * CHANNELS + j] =
-                                float(p[j * AREA + k]) * 2/ 255.0 - 1;
+                            x[k * CHANNELS + j] = p[j * AREA + k];
                         }
                     }
-                    if ((cat == 0) || (e.label < cat)) {
-                        ++n;
-                    }
+                    ++m_size;
                 }
-                resize(n);
+                m_pixels.resize(m_size * DIM);
                 BOOST_VERIFY(is);
             }
+        public:
+            DataSet (): m_size(0), m_is_packed(false) {
+            }
+
+            void load (string const &path, bool big = false, int cat = 0) {
+                if (io::PackedDataSet::detect(path)) {
+                    loadPacked(path, cat);
+                }
+                else {
+                    loadOriginal(path, big, cat);
+                }
+            }
+
+            size_t size () const {
+                return m_size;
+            }
+
+            int label (size_t i) const {
+                if (!m_is_packed) return m_labels[i];
+                return m_packed.label(m_index.empty() ? i : m_index[i]);
+            }
+
+            /// Pixels of image i, HEIGHT x WIDTH x CHANNELS.
+            uint8_t const *pixels (size_t i) const {
+                if (!m_is_packed) return &m_pixels[i * DIM];
+                return reinterpret_cast<uint8_t const *>(m_packed.example(m_index.empty() ? i : m_index[i]));
+            }
         };
 
         class CifarInputNode: public core::ArrayNode, public role::LabelInput<int>, public role::BatchInput {
             DataSet m_examples;
             vector<int> m_labels;
+            // prefetch slots
+            vector<Array<>> m_slot_data;
+            vector<vector<int>> m_slot_labels;
+
+            void loadBatch (unsigned slot, vector<unsigned> const &index) {
+                Array<> &array = (slot == CURRENT) ? data() : m_slot_data[slot];
+                vector<int> &labels = (slot == CURRENT) ? m_labels : m_slot_labels[slot];
+                array.fill(0.0);
+                labels.clear();
+                Array<>::value_type *x = array.addr();
+                for (unsigned i: index) {
+                    labels.push_back(m_examples.label(i));
+                    io::unpack(m_examples.pixels(i), DIM, x);
+                    x = array.walk<0>(x);
+                }
+            }
+
+            void swapBatch (unsigned slot) {
+                data().swap(m_slot_data[slot]);
+                m_labels.swap(m_slot_labels[slot]);
+            }
         public:
             CifarInputNode (Model *model, Config const &config) 
                 : ArrayNode(model, config)
@@ -75,19 +143,21 @@ namespace argos {
                 }
                 LOG(info) << "loading image paths from " << path;
                 m_examples.load(path);
-                role::BatchInput::init(batch, m_examples.size(), mode());
+                unsigned prefetch = getConfig<unsigned>("prefetch", "argos.global.prefetch", 0);
+                role::BatchInput::init(batch, m_examples.size(), mode(), prefetch, model->random());
+                m_slot_data.resize(prefetch);
+                for (auto &array: m_slot_data) {
+                    array.resize(size);
+                }
+                m_slot_labels.resize(prefetch);
+            }
+
+            ~CifarInputNode () {
+                role::BatchInput::stop();
             }
 
             void predict () {
-                data().fill(0.0);
-                m_labels.clear(); //resize(m_batch);
-                Array<>::value_type *x = data().addr();
-                role::BatchInput::next([this, &x](unsigned i) {
-                    cifar::Example const &e = m_examples[i];
-                    m_labels.push_back(e.label);
-                    copy(e.data.begin(), e.data.end(), x);
-                    x = data().walk<0>(x);
-                });
+                role::BatchInput::fetch();
             }
 
             virtual vector<int> const &labels () const {
@@ -5,73 +5,122 @@ namespace argos {
     namespace combo {
         using namespace argos::core;
 
+        /// Convolution layer: convolution, neuron, pooling and normalization.
+        /**
+         * "impl" (fallback "argos.global.conv") selects how the convolution
+         * is computed: "chain" builds it from pad, window and local linear
+         * nodes, "direct" uses a single ConvNode which doesn't materialize
+         * the unfolded input.  "pool.impl" (default the same as "impl")
+         * likewise selects between window + pool and a single 2D pooling node.
+         * "norm.location" normalizes each location across channels instead
+         * of the whole sample.
+         */
         struct ConvNodeFactory: public NodeFactory {
         public:
             virtual Node *create (Model *model, Config const &config) const {
                 string name = config.get<string>("name");
-                {
+                string impl = config.get<string>("impl", model->config().get<string>("argos.global.conv", "chain"));
+                string conv;
+                if (impl == "direct") {
                     Config cfg;
-                    cfg.put("type", "pad");
+                    cfg.put("type", "conv-direct");
                     cfg.put("input", config.get<string>("input"));
-                    cfg.put("name", name + "_pad");
-                    cfg.put("width", config.get<size_t>("pad"));
-                    cfg.put("height", config.get<size_t>("pad"));
-                    PadNode *pad = model->createNode<PadNode>(cfg);
-                    BOOST_VERIFY(pad);
-                }
-                {
-                    Config cfg;
-                    cfg.put("type", "window");
-                    cfg.put("input", name + "_pad");
-                    cfg.put("name", name + "_window1");
+                    cfg.put("name", name + "_conv");
+                    cfg.put("pad", config.get<size_t>("pad"));
                     cfg.put("bin", config.get<size_t>("bin"));
                     cfg.put("step", config.get<size_t>("step"));
-                    WindowNode *window1 = model->createNode<WindowNode>(cfg);
-                    BOOST_VERIFY(window1);
-                }
-                {
-                    Config cfg;
-                    cfg.put("type", "linear");
-                    cfg.put("input", name + "_window1");
-                    cfg.put("name", name + "_linear");
-                    cfg.put("local", 1);
                     cfg.put("channel", config.get<size_t>("channel"));
                     cfg.put("meta", config.get<string>("meta", "$meta"));
-                    LinearNode *linear = model->createNode<LinearNode>(cfg);
-                    BOOST_VERIFY(linear);
+                    ConvNode *node = model->createNode<ConvNode>(cfg);
+                    BOOST_VERIFY(node);
+                    conv = name + "_conv";
+                }
+                else if (impl == "chain") {
+                    {
+                        Config cfg;
+                        cfg.put("type", "pad");
+                        cfg.put("input", config.get<string>("input"));
+                        cfg.put("name", name + "_pad");
+                        cfg.put("width", config.get<size_t>("pad"));
+                        cfg.put("height", config.get<size_t>("pad"));
+                        PadNode *pad = model->createNode<PadNode>(cfg);
+                        BOOST_VERIFY(pad);
+                    }
+                    {
+                        Config cfg;
+                        cfg.put("type", "window");
+                        cfg.put("input", name + "_pad");
+                        cfg.put("name", name + "_window1");
+                        cfg.put("bin", config.get<size_t>("bin"));
+                        cfg.put("step", config.get<size_t>("step"));
+                        WindowNode *window1 = model->createNode<WindowNode>(cfg);
+                        BOOST_VERIFY(window1);
+                    }
+                    {
+                        Config cfg;
+                        cfg.put("type", "linear");
+                        cfg.put("input", name + "_window1");
+                        cfg.put("name", name + "_linear");
+                        cfg.put("local", 1);
+                        cfg.put("channel", config.get<size_t>("channel"));
+                        cfg.put("meta", config.get<string>("meta", "$meta"));
+                        LinearNode *linear = model->createNode<LinearNode>(cfg);
+                        BOOST_VERIFY(linear);
+                    }
+                    conv = name + "_linear";
+                }
+                else {
+                    throw runtime_error("unknown conv impl " + impl);
                 }
                 {
                     Config cfg;
                     cfg.put("type", config.get<string>("neuron"));
                     cfg.put("name", name + "_neuron");
-                    cfg.put("input", name + "_linear");
+                    cfg.put("input", conv);
                     ArrayNode *neuron = model->createNode<ArrayNode>(cfg);
                     BOOST_VERIFY(neuron);
                 }
-                {
+                string pool_impl = config.get<string>("pool.impl", impl);
+                if (pool_impl == "direct") {
                     Config cfg;
-                    cfg.put("type", "window");
+                    cfg.put("type", config.get<string>("pool.type") + "2d");
+                    cfg.put("name", name + "_pool");
                     cfg.put("input", name + "_neuron");
-                    cfg.put("name", name + "_window2");
                     cfg.put("bin", config.get<size_t>("pool.bin"));
                     cfg.put("step", config.get<size_t>("pool.step"));
-                    WindowNode *window2 = model->createNode<WindowNode>(cfg);
-                    BOOST_VERIFY(window2);
-                }
-                {
-                    Config cfg;
-                    cfg.put("type", config.get<string>("pool.type"));
-                    cfg.put("name", name + "_pool");
-                    cfg.put("input", name + "_window2");
-                    cfg.put("channel", config.get<size_t>("channel"));
                     ArrayNode *pool = model->createNode<ArrayNode>(cfg);
                     BOOST_VERIFY(pool);
                 }
+                else if (pool_impl == "chain") {
+                    {
+                        Config cfg;
+                        cfg.put("type", "window");
+                        cfg.put("input", name + "_neuron");
+                        cfg.put("name", name + "_window2");
+                        cfg.put("bin", config.get<size_t>("pool.bin"));
+                        cfg.put("step", config.get<size_t>("pool.step"));
+                        WindowNode *window2 = model->createNode<WindowNode>(cfg);
+                        BOOST_VERIFY(window2);
+                    }
+                    {
+                        Config cfg;
+                        cfg.put("type", config.get<string>("pool.type"));
+                        cfg.put("name", name + "_pool");
+                        cfg.put("input", name + "_window2");
+                        cfg.put("channel", config.get<size_t>("channel"));
+                        ArrayNode *pool = model->createNode<ArrayNode>(cfg);
+                        BOOST_VERIFY(pool);
+                    }
+                }
+                else {
+                    throw runtime_error("unknown pool impl " + pool_impl);
+                }
                 {
                     Config cfg;
                     cfg.put("type", "norm");
                     cfg.put("name", name);
                     cfg.put("input", name + "_pool");
+                    cfg.put("location", config.get<int>("norm.location", 0));
                     ArrayNode *norm = model->createNode<ArrayNode>(cfg);
                     BOOST_VERIFY(norm);
                     return norm;
@@ -111,6 +160,8 @@ namespace argos {
             }
         };
 
+        /// Linear SVM: libsvm input, linear and hinge loss.
+        /** The input is fed in sparse form unless "sparse" is 0. */
         class SvmNodeFactory: public NodeFactory {
         public:
             virtual Node *create (Model *model, Config const &config) const {
@@ -122,6 +173,7 @@ namespace argos {
                     cfg.put("dim", config.get<string>("dim"));
                     cfg.put("train", config.get<string>("train"));
                     cfg.put("test", config.get<string>("test"));
+                    cfg.put("sparse", config.get<int>("sparse", 1));
                     cfg.put("name", name + "_input");
                     Node *input = model->createNode<Node>(cfg);
                     BOOST_VERIFY(input);
@@ -139,7 +191,7 @@ namespace argos {
                     Config cfg;
                     cfg.put("type", "hinge");
                     cfg.put("input", name + "_linear");
-                    cfg.put("labels", name + "_input");
+                    cfg.put("label", name + "_input");
                     cfg.put("name", name);
                     Node *loss = model->createNode<Node>(cfg);
                     BOOST_VERIFY(loss);
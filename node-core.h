@@ -3,6 +3,7 @@
 
 #include <iostream>
 #include <sstream>
+#include <limits>
 #include <boost/lexical_cast.hpp>
 #include "array.h"
 #include "argos.h"
@@ -13,7 +14,7 @@ namespace argos {
     namespace role {
         class ArrayLabelInput: public virtual Role {
         public:
-            virtual Array<double> const &labels () const = 0;
+            virtual Array<> const &labels () const = 0;
         };
     }
 
@@ -42,7 +43,7 @@ namespace argos {
             }
         };
 
-        class ArrayNode: public Node {
+        class ArrayNode: public Node, public role::Transient {
         public:
             enum {
                 FLAT = 0,
@@ -54,36 +55,123 @@ namespace argos {
             Array<> m_data;
             Array<> m_delta;
             int m_type;
+            bool m_transient;
+            bool m_update_reads_data;
+            ArrayNode const *m_inplace;
+            ArrayNode const *m_shares;
+            vector<ArrayNode *> m_sharers;
         protected:
+            // Declare that predict rewrites all of data() from the inputs,
+            // so the memory planner can share its storage, and that update
+            // does not read data(): in training the storage is free for an
+            // in-place consumer once predict is done with it.
+            void setTransient () {
+                m_transient = true;
+                m_update_reads_data = false;
+            }
+            // Same, but update reads data() (e.g. the derivative is taken
+            // from the output), so in training data() must survive until
+            // update.
+            void setTransientReadByUpdate () {
+                m_transient = true;
+                m_update_reads_data = true;
+            }
+            // Declare that predict no longer writes data(), which is then
+            // left without storage (for rewrites taking over the output).
+            void dropData () {
+                m_transient = false;
+                m_data.bind(nullptr);
+            }
+            // Declare that predict and update still work if data() is
+            // the same storage as data() of the input.
+            void setInplace (ArrayNode const *input) {
+                m_inplace = input;
+            }
+            // Delta is only allocated when training; prediction models
+            // never propagate gradients.  Both start as zeros.
             void resize (ArrayNode const &node) {
-                m_size = node.m_size;
-                m_data.resize(m_size);
-                m_delta.resize(m_size);
+                resize(node.m_size);
             }
             void resize (vector<size_t> const &size) {
                 m_size = size;
                 m_data.resize(size);
-                m_delta.resize(size);
+                m_data.fill(0);
+                if (hasDelta()) {
+                    m_delta.resize(size);
+                    m_delta.fill(0);
+                }
+            }
+            // Set the shape only, without data or delta storage, for
+            // nodes that provide their activation in another form.
+            void reshape (vector<size_t> const &size) {
+                m_size = size;
+                m_data.clear();
+                m_delta.clear();
+            }
+            void checkDelta () const {
+                if (!hasDelta()) {
+                    throw runtime_error("delta of " + name() + " is not available in prediction mode");
+                }
             }
             void setType (int type) {
                 m_type = type;
             }
         public:
-            ArrayNode (Model *model, Config const &config) : Node(model, config), m_type(FLAT) {
+            ArrayNode (Model *model, Config const &config)
+                : Node(model, config), m_type(FLAT),
+                m_transient(false), m_update_reads_data(true), m_inplace(nullptr), m_shares(nullptr) {
             }
             vector<size_t> const& size () const { return m_size; }
             Array<> &data () { return m_data; }
-            Array<> &delta () { return m_delta; }
+            Array<> &delta () { checkDelta(); return m_delta; }
             Array<> const &data () const { return m_data; }
-            Array<> const &delta () const { return m_delta; }
+            Array<> const &delta () const { checkDelta(); return m_delta; }
+            bool hasDelta () const { return mode() != MODE_PREDICT; }
             void preupdate ()  {
                 delta().fill(0);
             }
             int type () const {
                 return m_type;
             }
+            size_t activationSize () const {
+                return m_transient ? m_data.size() * sizeof(Array<>::value_type) : 0;
+            }
+            bool activationUsedByUpdate () const {
+                return m_update_reads_data;
+            }
+            Node const *inplace () const {
+                return m_inplace;
+            }
+            void bindActivation (void *ptr) {
+                if (ptr) {
+                    m_data.bind(static_cast<Array<>::value_type *>(ptr));
+                }
+                else {
+                    m_data.unbind();
+                }
+                for (ArrayNode *node: m_sharers) {
+                    node->bindActivation(m_data.addr());
+                }
+            }
+            Node const *shares () const {
+                return m_shares;
+            }
+            // Make data() of node, of the same size, a view of data() of
+            // this node, wherever the memory planner puts it (for rewrites).
+            void shareData (ArrayNode *node) {
+                BOOST_VERIFY(node->m_data.size() == m_data.size());
+                BOOST_VERIFY(node->m_shares == nullptr);
+                node->m_transient = false;
+                node->m_shares = this;
+                m_sharers.push_back(node);
+                node->bindActivation(m_data.addr());
+            }
             void report (ostream &os) const {
-                os << name() << ":\tdata/" << data().l2() << "\tdelta/" <<  delta().l2() << endl;
+                os << name() << ":\tdata/" << data().l2();
+                if (hasDelta()) {
+                    os << "\tdelta/" <<  delta().l2();
+                }
+                os << endl;
             }
 
             virtual void handle (http::server::request const &req, http::server::reply &rep) const {
@@ -190,13 +278,19 @@ namespace argos {
 
         // 
         class LogPOutputNode: public MaxScoreOutputNode, public role::Loss {
+            bool m_fused;
         public:
             LogPOutputNode (Model *model, Config const &config) 
-                : MaxScoreOutputNode(model, config)
+                : MaxScoreOutputNode(model, config), m_fused(false)
             {
                   role::Loss::init({"loss", "error"});
             }
 
+            /// The input (softmax) computes the gradient of loss on its own input.
+            void fuse () {
+                m_fused = true;
+            }
+
             void predict () {
                 MaxScoreOutputNode::predict();
                 Array<>::value_type const *x = m_input->data().addr();
@@ -227,6 +321,7 @@ namespace argos {
             }
 
             void update () {
+                if (m_fused) return;
                 Array<>::value_type const *x = m_input->data().addr();
                 Array<>::value_type *dx = m_input->delta().addr();
                 vector<int> const &truth = inputLabels();
@@ -352,7 +447,7 @@ namespace argos {
                 m_label_input = model->findNode<role::ArrayLabelInput>(config.get<string>("label"));
                 BOOST_VERIFY(m_label_input);
             }
-            Array<double> const &inputLabels () const { return m_label_input->labels(); }
+            Array<> const &inputLabels () const { return m_label_input->labels(); }
         };
 
         class MultiRegressionOutputNode: public ArrayOutputNode, public role::Loss {
@@ -433,11 +528,14 @@ namespace argos {
             // which is the activate function itself,
             // and a backward function, which is the derivative
             // of the activate function as a function of y.
+            // inplace is set if backward is still correct when x and y
+            // are in the same storage (x is overwritten by y).
             //
             struct id { // identity, for testing
                 static string name () {
                     return "id";
                 }
+                static constexpr bool inplace = true;
                 template <typename T>
                 static T forward (T x) {
                     return x;
@@ -451,6 +549,7 @@ namespace argos {
                 static string name () {
                     return "relu";
                 }
+                static constexpr bool inplace = true;
                 template <typename T>
                 static T forward (T x) {
                     return x > 0 ? x : 0;
@@ -464,6 +563,7 @@ namespace argos {
                 static string name () {
                     return "softrelu";
                 }
+                static constexpr bool inplace = false;
                 template <typename T>
                 static T forward (T x) {
                     return log(1+exp(x));
@@ -478,6 +578,7 @@ namespace argos {
                 static string name () {
                     return "tanh";
                 }
+                static constexpr bool inplace = true;
                 template <typename T>
                 static T forward (T x) {
                     return std::tanh(x);
@@ -491,6 +592,7 @@ namespace argos {
                 static string name () {
                     return "logistic";
                 }
+                static constexpr bool inplace = true;
                 template <typename T>
                 static T forward (T x) {
                     return 1/(1 + std::exp(-x));
@@ -502,19 +604,59 @@ namespace argos {
             };
         }
 
-        template <typename F>
-        class FunctionNode: public ArrayNode
+        /// Function node as seen by rewrites, whatever the function.
+        class ActivationNode: public ArrayNode
         {
+        protected:
             ArrayNode *m_input;
+            bool m_fused;
         public:
-            FunctionNode (Model *model, Config const &config)
-                : ArrayNode(model, config) {
+            /// Applies the function in place to n values.
+            typedef void (*Forward) (Array<>::value_type *, size_t n);
+
+            ActivationNode (Model *model, Config const &config)
+                : ArrayNode(model, config), m_fused(false) {
                 m_input = findInputAndAdd<ArrayNode>("input", "input");
+            }
+            ArrayNode *input () const {
+                return m_input;
+            }
+            /// nullptr if the function can't be computed in place.
+            virtual Forward forward () const = 0;
+            /// The input applies forward() to its own activation, which
+            /// becomes the activation of this node.
+            void fuse () {
+                BOOST_VERIFY(forward());
+                m_input->shareData(this);
+                m_fused = true;
+            }
+        };
+
+        template <typename F>
+        class FunctionNode: public ActivationNode
+        {
+            static void apply (Array<>::value_type *y, size_t n) {
+                for (size_t i = 0; i < n; ++i) {
+                    y[i] = F::forward(y[i]);
+                }
+            }
+        public:
+            FunctionNode (Model *model, Config const &config)
+                : ActivationNode(model, config) {
                 resize(*m_input);
                 setType(m_input->type());
+                setTransientReadByUpdate();
+                if (F::inplace) {
+                    setInplace(m_input);
+                }
+            }
+
+            Forward forward () const {
+                return F::inplace ? &apply : nullptr;
             }
 
             void predict () {
+                if (m_fused) return;
                 data().apply(m_input->data(), [](Array<>::value_type &y, Array<>::value_type x){y = F::forward(x);});
             }
 
@@ -526,38 +668,191 @@ namespace argos {
             }
         };
 
+        /// Parameters, updated by SGD with momentum and weight decay.
+        /**
+         * Values and momentum are views into the parameter store of the
+         * model (see Model::paramData).
+         *
+         * With "lazy" (training only), the parameters are a matrix of rows
+         * of "row" values and a row is only updated when it is used.  Each
+         * row records the step it is current at; a consumer calls touch()
+         * on the rows it is going to read or add gradient to, which applies
+         * the decay and momentum steps the row has missed in closed form.
+         * Steps are then O(rows used) instead of O(size), which is what
+         * sparse input needs.  The gradient norm clipping of the dense mode
+         * is not applied.  All rows are brought up to date before the
+         * parameters are saved, synced or checked.
+         */
         class ParamNode: public ArrayNode, public role::Params {
             Meta  *m_meta;
             double m_init;
+            // lazy mode
+            bool m_lazy;
+            size_t m_row;                       // values per row
+            mutable unsigned m_step;            // steps taken
+            mutable vector<unsigned> m_stamp;   // step each row is current at
+            mutable vector<array<double, 3>> m_coef;    // catch-up coefficients by steps missed
+
+            // Catch-up coefficients of k steps, each being
+            //      x = (1 - lambda) x - eta d;  d = mom d
+            // which give x = A x - eta S d, d = M d with A = (1 - lambda)^k,
+            // M = mom^k, S = sum_{i<k} (1 - lambda)^{k-1-i} mom^i.
+            array<double, 3> coef (unsigned k) const {
+                double a = 1.0 - m_meta->lambda();
+                double m = m_meta->mom();
+                array<double, 3> c{{std::pow(a, k), std::pow(m, k), 0}};
+                if (k <= 64) {
+                    // S_{i+1} = a S_i + m^i, avoids cancellation when a ~ m
+                    double s = 0, mi = 1;
+                    for (unsigned i = 0; i < k; ++i) {
+                        s = s * a + mi;
+                        mi *= m;
+                    }
+                    c[2] = s;
+                }
+                else if (std::fabs(a - m) < 1e-8) {
+                    c[2] = k * std::pow(a, k - 1);
+                }
+                else {
+                    c[2] = (c[0] - c[1]) / (a - m);
+                }
+                return c;
+            }
+
+            void catchUp (size_t row) const {
+                unsigned k = m_step - m_stamp[row];
+                if (k == 0) return;
+                m_stamp[row] = m_step;
+                array<double, 3> c = (k < m_coef.size()) ? m_coef[k] : coef(k);
+                double eta = m_meta->eta();
+                // catching up does not change the parameters as seen from outside
+                ParamNode *self = const_cast<ParamNode *>(this);
+                real_t *x = self->data().addr() + row * m_row;
+                real_t *d = self->delta().addr() + row * m_row;
+                for (size_t i = 0; i < m_row; ++i) {
+                    x[i] = c[0] * x[i] - eta * c[2] * d[i];
+                    d[i] *= c[1];
+                }
+            }
+
+            // cache coefficients for up to k steps
+            void cacheCoef (unsigned k) const {
+                k = std::min(k, 4096u);
+                for (size_t i = m_coef.size(); i <= k; ++i) {
+                    m_coef.push_back(coef(i));
+                }
+            }
+
         public:
             ParamNode (Model *model, Config const &config)
                 : ArrayNode(model, config),
                   m_meta(findInputAndAdd<Meta>("meta", "meta", "$meta")),
-                  m_init(config.get<double>("init", model->config().get<double>("argos.global.init", 0)))
+                  m_init(config.get<double>("init", model->config().get<double>("argos.global.init", 0))),
+                  m_lazy(config.get<int>("lazy", 0) != 0 && mode() == MODE_TRAIN),
+                  m_row(config.get<size_t>("row", 1)),
+                  m_step(0)
             {
                 vector<size_t> size;
                 size.push_back(config.get<size_t>("size"));
                 resize(size); 
+                if (m_lazy) {
+                    BOOST_VERIFY(size[0] % m_row == 0);
+                    m_stamp.resize(size[0] / m_row, 0);
+                }
+            }
+
+            bool lazy () const {
+                return m_lazy;
+            }
+
+            void prepare (Plan *plan) {
+                ArrayNode::prepare(plan);
+                // touch() is not thread-safe, and the parallel scheduler may
+                // run the tasks of several consumers at the same time
+                if (m_lazy && outputs().size() > 1
+                        && model()->config().get<string>("argos.global.scheduler", "serial") == "parallel") {
+                    throw runtime_error(name() + ": lazy parameters shared by several nodes need the serial scheduler or lazy=0");
+                }
+            }
+
+            void bindParams (real_t *x, real_t *d) {
+                std::copy(data().addr(), data().addr() + data().size(), x);
+                data().bind(x);
+                if (d) {
+                    std::copy(delta().addr(), delta().addr() + delta().size(), d);
+                    delta().bind(d);
+                }
+            }
+
+            // bring all rows up to date
+            void flush () const {
+                if (!m_lazy) return;
+                cacheCoef(m_step);
+#pragma omp parallel for schedule(static) num_threads(parallel::threads(data().size()))
+                for (size_t r = 0; r < m_stamp.size(); ++r) {
+                    catchUp(r);
+                }
+            }
+
+            void replaced () {
+                std::fill(m_stamp.begin(), m_stamp.end(), m_step);
+            }
+
+            /// Bring rows [begin, end) of indices up to date (lazy mode).
+            /** Rows must be touched before their data are read or gradient
+             * is added to them in a step; not thread-safe, so lazy
+             * parameters have a single consumer with the parallel scheduler. */
+            template <typename I>
+            void touch (I begin, I end) {
+                if (!m_lazy) return;
+                cacheCoef(64);
+                for (I i = begin; i != end; ++i) {
+                    catchUp(*i);
+                }
             }
 
             void sync (Node const *fromNode) {
                 ParamNode const *from = dynamic_cast<ParamNode const *>(fromNode);
                 BOOST_VERIFY(from);
+                from->flush();
                 data().sync(from->data());
-                delta().sync(from->delta());
+                if (hasDelta() && from->hasDelta()) {
+                    delta().sync(from->delta());
+                }
+                replaced();
             }
 
+            // The saved state always includes the momentum (delta), zeros
+            // when saved from a prediction model, so the file layout does
+            // not depend on the mode.
             void save (ostream &os) const {
-                os.write((char const *)this->data().addr(), sizeof(Array<>::value_type) * this->data().size());
-                os.write((char const *)this->delta().addr(), sizeof(Array<>::value_type) * this->delta().size());
+                flush();
+                size_t bytes = sizeof(Array<>::value_type) * this->data().size();
+                os.write((char const *)this->data().addr(), bytes);
+                if (hasDelta()) {
+                    os.write((char const *)this->delta().addr(), bytes);
+                }
+                else {
+                    vector<char> zero(bytes, 0);
+                    os.write(&zero[0], bytes);
+                }
             }
             void load (istream &is) {
-                is.read((char *)this->data().addr(), sizeof(Array<>::value_type) * this->data().size());
-                is.read((char *)this->delta().addr(), sizeof(Array<>::value_type) * this->delta().size());
+                size_t bytes = sizeof(Array<>::value_type) * this->data().size();
+                is.read((char *)this->data().addr(), bytes);
+                if (hasDelta()) {
+                    is.read((char *)this->delta().addr(), bytes);
+                }
+                else {
+                    is.ignore(bytes);
+                }
+                replaced();
             }
 
             void init () {
-                delta().fill(0);
+                if (hasDelta()) {
+                    delta().fill(0);
+                }
                 if (m_init == 0) {
                     //cerr << "INIT0 " << name() << endl;
                     data().fill(0);
@@ -568,61 +863,78 @@ namespace argos {
                     Model::Random &random = model()->random();
                     data().apply_serial([&normal, &random](Array<>::value_type &y) {y = normal(random);});
                 }
+                replaced();
             }
 
             void predict () {
                 if (mode() == MODE_TRAIN) {
-                    double dl2 = delta().l2();
-                    double xl2 = data().l2();
-                    if (m_meta->lambda()) {
-                        data().scale(1.0 - m_meta->lambda());
-                    }
-                    if (m_meta->eta() * xl2 < dl2) {
-                        data().add_scaled(-m_meta->eta() * xl2 / dl2, delta());
-                    }
-                    else {
-                        data().add_scaled(-m_meta->eta(), delta());
+                    if (m_lazy) {
+                        // the step, momentum scaling included, is applied
+                        // to each row when it is touched
+                        ++m_step;
+                        return;
                     }
+                    step();
                 }
             }
 
-            void preupdate () {
-                if (mode() == MODE_TRAIN) {
-                    if (m_meta->mom() == 0) {   // m_mom has to be 0 for verify mode
-                        delta().fill(0);
-                    }
-                    else {
-                        delta().scale(m_meta->mom());
+            // One step in two parallel passes: both norms, then decay,
+            // clipped update, and the momentum scaling that preupdate used
+            // to do (nothing reads the delta in between).
+            void step () {
+                real_t *x = data().addr();
+                real_t *d = delta().addr();
+                size_t n = data().size();
+                double dd = 0, xx = 0;
+#pragma omp parallel for simd reduction(+:dd, xx) schedule(static) num_threads(parallel::threads(n))
+                for (size_t i = 0; i < n; ++i) {
+                    dd += double(d[i]) * d[i];
+                    xx += double(x[i]) * x[i];
+                }
+                double dl2 = std::sqrt(dd);
+                double xl2 = std::sqrt(xx);
+                double eta = m_meta->eta();
+                real_t decay = 1.0 - m_meta->lambda();
+                real_t rate = (eta * xl2 < dl2) ? eta * xl2 / dl2 : eta;
+                real_t mom = m_meta->mom();
+                if (mom == 0) {     // m_mom has to be 0 for verify mode
+#pragma omp parallel for simd schedule(static) num_threads(parallel::threads(n))
+                    for (size_t i = 0; i < n; ++i) {
+                        x[i] = decay * x[i] - rate * d[i];
+                        d[i] = 0;
                     }
-                    // get norm scale
-                    /*
-                    double dl2 = delta().l2();
-                    if (dl2 == 0) return;
-                    double rate = data().l2() / dl2 * m_meta->lambda();
-                    */
-                    /*
-                    if (m_meta->lambda()) {
-                        delta().add_scaled(m_meta->lambda(), data());
-                        //delta().add_scaled(rate, data());
+                }
+                else {
+#pragma omp parallel for simd schedule(static) num_threads(parallel::threads(n))
+                    for (size_t i = 0; i < n; ++i) {
+                        x[i] = decay * x[i] - rate * d[i];
+                        d[i] *= mom;
                     }
-                    */
                 }
             }
+
+            void preupdate () {
+                // momentum is applied by step
+            }
+
             size_t dim () const {
                 return data().size();
             }
 
             void perturb (size_t index, double epsilon) {
+                flush();
                 auto addr = data().addr();
                 addr[index] += epsilon;
             }
 
             double gradient (size_t index) const {
+                flush();
                 auto addr = delta().addr();
                 return addr[index];
             }
 
             double value (size_t index) const {
+                flush();
                 auto addr = data().addr();
                 return addr[index];
             }
@@ -651,7 +963,9 @@ namespace argos {
                 }
                 resize(m_output_shape);
                 data().fill(0);
-                delta().fill(0);
+                if (hasDelta()) {
+                    delta().fill(0);
+                }
             }
 
             void predict () {
@@ -703,6 +1017,7 @@ namespace argos {
 
         class LinearNode: public ArrayNode {
             ArrayNode *m_input;
+            role::SparseActivation const *m_sparse;    // input in sparse mode
             ParamNode *m_weight;
             ParamNode *m_bias;
             bool m_local;
@@ -711,12 +1026,161 @@ namespace argos {
                             // local: m_rows = m_samples * height [* width]
             size_t m_input_size;
             size_t m_output_size;
+            // set by rewrites, see namespace fusion
+            bool m_bias_epilogue;               // add bias after gemm instead of tiling it before
+            ActivationNode::Forward m_activation;   // then apply this, if not nullptr
+            ArrayNode const *m_source;          // fused normalize: multiply its input...
+            vector<Array<>::value_type> const *m_row_scale;    // ...and scale the rows by its rates
+            vector<Array<>::value_type> m_scaled_delta;
+
+            vector<Array<>::value_type> m_bias_partial;    // per block column sums of delta
+
+            // Dense gemms with a bias epilogue go by blocks of this many
+            // rows, a block of output (~256KB) staying in cache from the
+            // gemm to the epilogue, or from the input delta gemm to the
+            // bias reduction.  Each block streams the whole weight matrix,
+            // so only local linears with a narrow output (blocks of at
+            // least MIN_BLOCK_ROWS rows) are blocked; others take a single
+            // block: one gemm, then the epilogue.
+            static constexpr size_t MIN_BLOCK_ROWS = 128;
+            size_t blockRows () const {
+                size_t rows = (size_t(1) << 18) / sizeof(Array<>::value_type) / m_output_size;
+                return (m_local && rows >= MIN_BLOCK_ROWS) ? rows : m_rows;
+            }
+
+            // Output rows [begin, end) after gemm, in one pass: scale, bias, activation.
+            void epilogue (size_t begin, size_t end) {
+                bool bias = m_bias_epilogue && !m_sparse;
+                Array<>::value_type const *b = m_bias->data().addr();
+                size_t n = m_output_size;
+                for (size_t r = begin; r < end; ++r) {
+                    Array<>::value_type *yr = data().addr() + r * n;
+                    if (m_row_scale) {
+                        simd::scale(yr, (*m_row_scale)[r], n);
+                    }
+                    if (bias) {
+                        simd::add(yr, b, n);
+                    }
+                    if (m_activation) {
+                        m_activation(yr, n);
+                    }
+                }
+            }
+
+            void epilogue () {
+                if (!(m_bias_epilogue && !m_sparse) && !m_activation && !m_row_scale) return;
+#pragma omp parallel for schedule(static) num_threads(parallel::threads(m_rows * m_output_size))
+                for (size_t r = 0; r < m_rows; ++r) {
+                    epilogue(r, r + 1);
+                }
+            }
+
+            // Dense predict with the bias epilogue: gemm and epilogue of each
+            // block of rows back to back, blocks in parallel.  With a single
+            // block, the gemm gets all threads itself.
+            void predictBlocked () {
+                ArrayNode const *input = m_source ? m_source : m_input;
+                size_t block = blockRows();
+                size_t blocks = (m_rows + block - 1) / block;
+                if (blocks == 1) {
+                    blas::gemm<Array<>::value_type>(input->data().addr(), m_rows, m_input_size, false,
+                               m_weight->data().addr(), m_input_size, m_output_size, false,
+                               this->data().addr(), m_rows, m_output_size, 1.0, 0.0);
+                    epilogue();
+                    return;
+                }
+#pragma omp parallel for schedule(static) num_threads(parallel::threads(m_rows * m_input_size * m_output_size))
+                for (size_t k = 0; k < blocks; ++k) {
+                    size_t begin = k * block;
+                    size_t rows = std::min(m_rows, begin + block) - begin;
+                    blas::gemm<Array<>::value_type>(input->data().addr() + begin * m_input_size, rows, m_input_size, false,
+                               m_weight->data().addr(), m_input_size, m_output_size, false,
+                               this->data().addr() + begin * m_output_size, rows, m_output_size, 1.0, 0.0);
+                    epilogue(begin, begin + rows);
+                }
+            }
+
+            // Dense input delta with the bias epilogue: each block of rows
+            // gets its gemm and its column sums of delta (and the scaled
+            // delta of a fused normalize) while in cache.  The block sums
+            // are added up in block order, so the bias gradient does not
+            // depend on the number of threads.
+            void updateInputBlocked () {
+                size_t block = blockRows();
+                size_t blocks = (m_rows + block - 1) / block;
+                size_t n = m_output_size;
+                Array<>::value_type const *d = delta().addr();
+                if (blocks == 1) {
+                    blas::gemm<Array<>::value_type>(d, m_rows, n, false,
+                               m_weight->data().addr(), m_input_size, n, true,
+                               m_input->delta().addr(), m_rows, m_input_size, 1.0, 1.0);
+                    updateBias();
+                    return;
+                }
+                m_bias_partial.assign(blocks * n, 0);
+#pragma omp parallel for schedule(static) num_threads(parallel::threads(m_rows * m_input_size * n))
+                for (size_t k = 0; k < blocks; ++k) {
+                    size_t begin = k * block;
+                    size_t rows = std::min(m_rows, begin + block) - begin;
+                    blas::gemm<Array<>::value_type>(d + begin * n, rows, n, false,
+                               m_weight->data().addr(), m_input_size, n, true,
+                               m_input->delta().addr() + begin * m_input_size, rows, m_input_size, 1.0, 1.0);
+                    Array<>::value_type *sum = &m_bias_partial[k * n];
+                    for (size_t r = begin; r < begin + rows; ++r) {
+                        simd::add(sum, d + r * n, n);
+                        if (m_row_scale) {
+                            Array<>::value_type *sd = &m_scaled_delta[r * n];
+                            std::copy(d + r * n, d + (r + 1) * n, sd);
+                            simd::scale(sd, (*m_row_scale)[r], n);
+                        }
+                    }
+                }
+                Array<>::value_type *bd = m_bias->delta().addr();
+                for (size_t k = 0; k < blocks; ++k) {
+                    simd::axpy(bd, Array<>::value_type(1.0/m_samples), &m_bias_partial[k * n], n);
+                }
+            }
+
+            // Column sums of delta into the bias delta (and the scaled delta
+            // of a fused normalize) by slices of columns, each slice adding
+            // up the rows in order.
+            void updateBias () {
+                static constexpr size_t SLICE = 256;
+                size_t n = m_output_size;
+                size_t slices = (n + SLICE - 1) / SLICE;
+                m_bias_partial.assign(n, 0);
+                Array<>::value_type const *d = delta().addr();
+#pragma omp parallel for schedule(static) num_threads(parallel::threads(m_rows * n))
+                for (size_t k = 0; k < slices; ++k) {
+                    size_t begin = k * SLICE;
+                    size_t cols = std::min(n, begin + SLICE) - begin;
+                    Array<>::value_type *sum = &m_bias_partial[begin];
+                    for (size_t r = 0; r < m_rows; ++r) {
+                        Array<>::value_type const *dr = d + r * n + begin;
+                        simd::add(sum, dr, cols);
+                        if (m_row_scale) {
+                            Array<>::value_type *sd = &m_scaled_delta[r * n + begin];
+                            std::copy(dr, dr + cols, sd);
+                            simd::scale(sd, (*m_row_scale)[r], cols);
+                        }
+                    }
+                }
+                simd::axpy(m_bias->delta().addr(), Array<>::value_type(1.0/m_samples), &m_bias_partial[0], n);
+            }
         public:
             LinearNode (Model *model, Config const &config)
-                : ArrayNode(model, config)
+                : ArrayNode(model, config),
+                m_bias_epilogue(false), m_activation(nullptr), m_source(nullptr), m_row_scale(nullptr)
             {
                 m_input = findInputAndAdd<ArrayNode>("input", "input");
+                m_sparse = dynamic_cast<role::SparseActivation const *>(m_input);
+                if (m_sparse && !m_sparse->isSparse()) {
+                    m_sparse = nullptr;
+                }
                 if (config.get<int>("local", 0) != 0) {
+                    if (m_sparse) {
+                        throw runtime_error(name() + ": local linear does not support sparse input");
+                    }
                     //cerr << "LOCAL " << name() << endl;
                     m_local = true;
                     vector<size_t> size;
@@ -747,14 +1211,20 @@ namespace argos {
                 }
                 else {
                     m_local = false;
-                    m_samples = m_rows = m_input->data().size(size_t(0));
-                    m_input_size = m_input->data().size() / m_samples;
+                    // from the shape, which a sparse input has without data
+                    vector<size_t> const &isize = m_input->size();
+                    m_samples = m_rows = isize[0];
+                    m_input_size = 1;
+                    for (size_t i = 1; i < isize.size(); ++i) {
+                        m_input_size *= isize[i];
+                    }
                     m_output_size = config.get<size_t>("channel");
                     vector<size_t> size;
                     size.push_back(m_samples);
                     size.push_back(m_output_size);
                     resize(size);
                 }
+                setTransient();
 
                 m_weight = nullptr;
                 try {
@@ -769,10 +1239,18 @@ namespace argos {
                     wconfig.put("type", "param");
                     wconfig.put("size", m_input_size * m_output_size); 
                     wconfig.put("meta", config.get<string>("meta", "$meta"));
+                    if (m_sparse) {
+                        // one row per input feature, updated only when the feature occurs
+                        wconfig.put("lazy", config.get<int>("lazy", 1));
+                        wconfig.put("row", m_output_size);
+                    }
                     m_weight = model->createNode<ParamNode>(wconfig);
                     BOOST_VERIFY(m_weight);
                 }
                 addInput(m_weight, "weight");
+                if (m_weight->lazy() && !m_sparse) {
+                    throw runtime_error(name() + ": lazy weight needs sparse input");
+                }
 
                 m_bias = nullptr;
                 try {
@@ -795,24 +1273,141 @@ namespace argos {
                 BOOST_VERIFY(m_weight->data().size() == m_input_size * m_output_size);
             }
 
+            ArrayNode *input () const {
+                return m_input;
+            }
+            bool sparse () const {
+                return m_sparse != nullptr;
+            }
+            bool local () const {
+                return m_local;
+            }
+            /// Whether the gemm goes by several blocks of rows with the bias
+            /// epilogue (see fusion::LinearBias).
+            bool blocked () const {
+                return !m_sparse && blockRows() < m_rows;
+            }
+            void fuseBias () {
+                m_bias_epilogue = true;
+            }
+            void fuseActivation (ActivationNode::Forward f) {
+                BOOST_VERIFY(m_activation == nullptr);
+                m_activation = f;
+            }
+            /// Compute from source, with row r of the output scaled by
+            /// scale[r], what would be computed from the input.
+            void fuseRowScale (ArrayNode const *source, vector<Array<>::value_type> const *scale) {
+                BOOST_VERIFY(!m_sparse && !m_local);
+                BOOST_VERIFY(source->data().size() == m_rows * m_input_size);
+                m_source = source;
+                m_row_scale = scale;
+                m_bias_epilogue = true;     // the bias is not scaled
+                if (hasDelta()) {
+                    m_scaled_delta.resize(m_rows * m_output_size);
+                }
+            }
+
+            vector<Node const *> reads () const {
+                vector<Node const *> v;
+                if (m_source) v.push_back(m_source);
+                return v;
+            }
+
             void predict () {
-                data().tile(m_bias->data());
-                blas::gemm<Array<>::value_type>(m_input->data().addr(), m_rows, m_input_size, false,
-                           m_weight->data().addr(), m_input_size, m_output_size, false,
-                           this->data().addr(), m_rows, m_output_size, 1.0, 1.0);
+                if (m_sparse) {
+                    data().tile(m_bias->data());
+                    predictSparse();
+                }
+                else if (m_bias_epilogue) {
+                    predictBlocked();
+                    return;
+                }
+                else {
+                    data().tile(m_bias->data());
+                    blas::gemm<Array<>::value_type>(m_input->data().addr(), m_rows, m_input_size, false,
+                               m_weight->data().addr(), m_input_size, m_output_size, false,
+                               this->data().addr(), m_rows, m_output_size, 1.0, 1.0);
+                }
+                epilogue();
+            }
+
+            // y[i] += sum of x[i][j] * w[j] over non-zeros j of row i
+            void predictSparse () {
+                SparseArray<> const &x = m_sparse->sparse();
+                vector<size_t> const &off = x.offsets();
+                unsigned const *idx = x.indices().empty() ? nullptr : &x.indices()[0];
+                real_t const *val = x.values().empty() ? nullptr : &x.values()[0];
+                real_t const *w = m_weight->data().addr();
+                real_t *y = data().addr();
+                size_t rows = std::min(x.rows(), m_rows);
+                m_weight->touch(idx, idx + off[rows]);
+#pragma omp parallel for schedule(dynamic, 16) num_threads(parallel::threads(off[rows] * m_output_size))
+                for (size_t i = 0; i < rows; ++i) {
+                    real_t *yi = y + i * m_output_size;
+                    for (size_t k = off[i]; k < off[i + 1]; ++k) {
+                        real_t const *wj = w + size_t(idx[k]) * m_output_size;
+                        real_t v = val[k];
+                        for (size_t c = 0; c < m_output_size; ++c) {
+                            yi[c] += v * wj[c];
+                        }
+                    }
+                }
+            }
+
+            // Only weight rows of non-zero inputs get gradient; there is
+            // no input delta.  Samples can share rows, so this is serial.
+            void updateSparse () {
+                SparseArray<> const &x = m_sparse->sparse();
+                vector<size_t> const &off = x.offsets();
+                real_t const *d = delta().addr();
+                real_t *wd = m_weight->delta().addr();
+                real_t scale = 1.0 / m_samples;
+                size_t rows = std::min(x.rows(), m_rows);
+                m_weight->touch(x.indices().begin(), x.indices().begin() + off[rows]);
+                for (size_t i = 0; i < rows; ++i) {
+                    real_t const *di = d + i * m_output_size;
+                    for (size_t k = off[i]; k < off[i + 1]; ++k) {
+                        real_t *wdj = wd + size_t(x.indices()[k]) * m_output_size;
+                        real_t v = scale * x.values()[k];
+                        for (size_t c = 0; c < m_output_size; ++c) {
+                            wdj[c] += v * di[c];
+                        }
+                    }
+                }
+                m_bias->delta().add_scaled_wrapping(1.0/m_samples, delta());
             }
 
             void update () {
+                if (m_sparse) {
+                    updateSparse();
+                    return;
+                }
                 //cerr << "UPDATE " << name() << endl;
-                // update input data
-                blas::gemm<Array<>::value_type>(this->delta().addr(), m_rows, m_output_size, false,
-                           m_weight->data().addr(), m_input_size, m_output_size, true,
-                           m_input->delta().addr(), m_rows, m_input_size, 1.0, 1.0);
+                // update input data, and bias with the epilogue
+                if (m_bias_epilogue) {
+                    updateInputBlocked();
+                }
+                else {
+                    blas::gemm<Array<>::value_type>(this->delta().addr(), m_rows, m_output_size, false,
+                               m_weight->data().addr(), m_input_size, m_output_size, true,
+                               m_input->delta().addr(), m_rows, m_input_size, 1.0, 1.0);
+                }
                 // update weight data
-                blas::gemm<Array<>::value_type>(m_input->data().addr(), m_rows, m_input_size, true,
-                           this->delta().addr(), m_rows, m_output_size, false,
-                           m_weight->delta().addr(), m_input_size, m_output_size, 1.0/m_samples, 1.0);
-                m_bias->delta().add_scaled_wrapping(1.0/m_samples, delta());
+                if (m_row_scale) {
+                    // x = scale * source, so x' d = source' (scale * d),
+                    // scale * d being left by updateInputBlocked
+                    blas::gemm<Array<>::value_type>(m_source->data().addr(), m_rows, m_input_size, true,
+                               &m_scaled_delta[0], m_rows, m_output_size, false,
+                               m_weight->delta().addr(), m_input_size, m_output_size, 1.0/m_samples, 1.0);
+                }
+                else {
+                    blas::gemm<Array<>::value_type>(m_input->data().addr(), m_rows, m_input_size, true,
+                               this->delta().addr(), m_rows, m_output_size, false,
+                               m_weight->delta().addr(), m_input_size, m_output_size, 1.0/m_samples, 1.0);
+                }
+                if (!m_bias_epilogue) {
+                    m_bias->delta().add_scaled_wrapping(1.0/m_samples, delta());
+                }
             }
         };
 
@@ -839,6 +1434,7 @@ namespace argos {
                 size.push_back(m_samples);
                 size.push_back(m_output_size);
                 resize(size);
+                setTransient();
 
                 m_weight = nullptr;
                 try {
@@ -888,14 +1484,11 @@ namespace argos {
                 Array<>::value_type *output = data().addr();
                 Array<>::value_type *weight = m_weight->data().addr();
                 BOOST_VERIFY(cols * m_output_size == m_weight->data().size());
-#pragma omp parallel for
+#pragma omp parallel for schedule(static) num_threads(parallel::threads(rows * cols))
                 for (size_t r = 0; r < rows; ++r) {
                     Array<>::value_type *i = input + r * cols;
-                    Array<>::value_type *o = output + r;
                     Array<>::value_type *w = weight + (r % m_output_size) * cols;
-                    for (unsigned d = 0; d < m_fan_in; ++d) {
-                        *o += i[d] * w[d];
-                    }
+                    output[r] += simd::dot(i, w, cols);
                 }
             }
 
@@ -907,16 +1500,19 @@ namespace argos {
                 Array<>::value_type const *output_delta = delta().addr();
                 Array<>::value_type const *weight = m_weight->data().addr();
                 Array<>::value_type *weight_delta = m_weight->delta().addr();
-//#pragma omp parallel for
-                for (size_t r = 0; r < rows; ++r) {
-                    Array<>::value_type const *i = input + r * cols;
-                    Array<>::value_type *id = input_delta + r * cols;
-                    Array<>::value_type const *od = output_delta + r;
-                    Array<>::value_type const *w = weight + (r % m_output_size) * cols;
-                    Array<>::value_type *wd = weight_delta + (r % m_output_size) * cols;
-                    for (unsigned d = 0; d < cols; ++d) {
-                        id[d] += w[d] * od[0];
-                        wd[d] += i[d] * od[0] / m_samples;
+                // Rows r of the same channel r % m_output_size share a weight
+                // slice, so threads take whole channels: each one owns its
+                // weight delta slice, and input delta rows are disjoint.
+                // Samples are still added in order, whatever the threads.
+#pragma omp parallel for schedule(static) num_threads(parallel::threads(rows * cols))
+                for (size_t c = 0; c < m_output_size; ++c) {
+                    Array<>::value_type const *w = weight + c * cols;
+                    Array<>::value_type *wd = weight_delta + c * cols;
+                    for (size_t s = 0; s < m_samples; ++s) {
+                        size_t r = s * m_output_size + c;
+                        Array<>::value_type od = output_delta[r];
+                        simd::axpy(input_delta + r * cols, od, w, cols);
+                        simd::axpy(wd, Array<>::value_type(od / m_samples), input + r * cols, cols);
                     }
                 }
                 m_bias->delta().add_scaled_wrapping(1.0/m_samples, delta());
@@ -1007,11 +1603,12 @@ namespace argos {
                 resize(size);
                 m_state.resize(size);
                 setType(m_input->type());
+                setTransient();
             }
 
             void predict () {
                 size_t n = m_input->data().size() / m_input_channel;
-#pragma omp parallel for
+#pragma omp parallel for schedule(static) num_threads(parallel::threads(m_input->data().size()))
                 for (size_t i = 0; i < n; ++i) {
                     Array<>::value_type const *input = m_input->data().addr() + i * m_input_channel;
                     typename POOL::state_type *state = m_state.addr() + i * m_output_channel;;
@@ -1022,7 +1619,7 @@ namespace argos {
 
             void update () {
                 size_t samples = m_input->data().size(size_t(0));
-#pragma omp parallel for
+#pragma omp parallel for schedule(static) num_threads(parallel::threads(m_input->data().size()))
                 for (size_t s = 0; s < samples; ++s) {
                     Array<>::value_type *input = m_input->delta().at(s);
                     typename POOL::state_type const *state = m_state.at(s);
@@ -1038,6 +1635,175 @@ namespace argos {
             }
         }; 
 
+        namespace pool2d {
+            // Pooling over a bin x bin window of a feature map, visiting
+            // window elements in the same order as WindowNode unfolds them.
+            // "in" points to the top-left pixel of the window, and rows of
+            // the feature map are "stride" values apart.
+            struct max {
+                static string name () {
+                    return "max";
+                }
+                static constexpr bool stateful = true;
+                typedef uint8_t state_type;     // index of max within window
+
+                template <typename T>
+                static void predict (T const *in, size_t stride, size_t bin, size_t channel, T *out, state_type *s) {
+                    copy(in, in + channel, out);
+                    fill(s, s + channel, 0);
+                    for (size_t l = 0; l < bin; ++l) {
+                        T const *row = in + l * stride;
+                        for (size_t k = (l == 0) ? 1 : 0; k < bin; ++k) {
+                            T const *x = row + k * channel;
+                            state_type i = l * bin + k;
+                            for (size_t c = 0; c < channel; ++c) {
+                                if (x[c] > out[c]) {
+                                    out[c] = x[c];
+                                    s[c] = i;
+                                }
+                            }
+                        }
+                    }
+                }
+
+                template <typename T>
+                static void update (T *in, size_t stride, size_t bin, size_t channel, T const *out, state_type const *s) {
+                    for (size_t c = 0; c < channel; ++c) {
+                        size_t l = s[c] / bin;
+                        size_t k = s[c] % bin;
+                        in[l * stride + k * channel + c] += out[c];
+                    }
+                }
+            };
+
+            struct avg {
+                static string name () {
+                    return "avg";
+                }
+                static constexpr bool stateful = false;
+                typedef uint8_t state_type;
+
+                template <typename T>
+                static void predict (T const *in, size_t stride, size_t bin, size_t channel, T *out, state_type *) {
+                    fill(out, out + channel, 0);
+                    for (size_t l = 0; l < bin; ++l) {
+                        T const *row = in + l * stride;
+                        for (size_t k = 0; k < bin; ++k) {
+                            T const *x = row + k * channel;
+                            for (size_t c = 0; c < channel; ++c) {
+                                out[c] += x[c];
+                            }
+                        }
+                    }
+                    unsigned n = bin * bin;
+                    for (size_t c = 0; c < channel; ++c) {
+                        out[c] /= n;
+                    }
+                }
+
+                template <typename T>
+                static void update (T *in, size_t stride, size_t bin, size_t channel, T const *out, state_type const *) {
+                    unsigned n = bin * bin;
+                    for (size_t l = 0; l < bin; ++l) {
+                        T *row = in + l * stride;
+                        for (size_t k = 0; k < bin; ++k) {
+                            T *x = row + k * channel;
+                            for (size_t c = 0; c < channel; ++c) {
+                                x[c] += out[c] / n;
+                            }
+                        }
+                    }
+                }
+            };
+        }
+
+        /// 2D pooling, computing the same as window + pool.
+        /**
+         * Windows are read directly from the input feature map, and only the
+         * position of the max within the window is kept for back-propagation.
+         */
+        template <typename POOL>
+        class Pool2DNode: public ArrayNode {
+            ArrayNode *m_input;
+            Array<typename POOL::state_type> m_state;
+            size_t m_bin;
+            size_t m_step;
+            size_t m_samples;
+            size_t m_height;
+            size_t m_width;
+            size_t m_channel;
+            size_t m_output_height;
+            size_t m_output_width;
+        public:
+            Pool2DNode (Model *model, Config const &config)
+                : ArrayNode(model, config),
+                  m_bin(config.get<size_t>("bin")),
+                  m_step(config.get<size_t>("step"))
+            {
+                m_input = findInputAndAdd<ArrayNode>("input", "input");
+                BOOST_VERIFY(m_input->type() == IMAGE);
+                if (m_bin * m_bin > std::numeric_limits<typename POOL::state_type>::max() + size_t(1)) {
+                    throw runtime_error("pooling bin too large");
+                }
+                vector<size_t> size;
+                m_input->data().size(&size);
+                BOOST_VERIFY(size.size() == 4);
+                m_samples = size[0];
+                m_height = size[1];
+                m_width = size[2];
+                m_channel = size[3];
+                BOOST_VERIFY(m_height >= m_bin && m_width >= m_bin);
+                m_output_height = 1 + (m_height - m_bin) / m_step;
+                m_output_width = 1 + (m_width - m_bin) / m_step;
+                size[1] = m_output_height;
+                size[2] = m_output_width;
+                resize(size);
+                if (POOL::stateful) {
+                    m_state.resize(size);
+                }
+                setType(IMAGE);
+                setTransient();
+            }
+
+            void predict () {
+                size_t stride = m_width * m_channel;
+                size_t rows = m_samples * m_output_height;
+#pragma omp parallel for schedule(static) num_threads(parallel::threads(m_input->data().size()))
+                for (size_t r = 0; r < rows; ++r) {
+                    size_t s = r / m_output_height;
+                    size_t y = r % m_output_height;
+                    Array<>::value_type const *in = m_input->data().at(s, y * m_step);
+                    Array<>::value_type *out = data().at(s, y);
+                    typename POOL::state_type *state = POOL::stateful ? m_state.at(s, y) : nullptr;
+                    for (size_t x = 0; x < m_output_width; ++x) {
+                        POOL::predict(in, stride, m_bin, m_channel, out, state);
+                        in += m_step * m_channel;
+                        out += m_channel;
+                        if (POOL::stateful) state += m_channel;
+                    }
+                }
+            }
+
+            void update () {
+                // windows overlap within a sample, so only samples are parallel
+                size_t stride = m_width * m_channel;
+#pragma omp parallel for schedule(static) num_threads(parallel::threads(m_input->data().size()))
+                for (size_t s = 0; s < m_samples; ++s) {
+                    for (size_t y = 0; y < m_output_height; ++y) {
+                        Array<>::value_type *in = m_input->delta().at(s, y * m_step);
+                        Array<>::value_type const *out = delta().at(s, y);
+                        typename POOL::state_type const *state = POOL::stateful ? m_state.at(s, y) : nullptr;
+                        for (size_t x = 0; x < m_output_width; ++x) {
+                            POOL::update(in, stride, m_bin, m_channel, out, state);
+                            in += m_step * m_channel;
+                            out += m_channel;
+                            if (POOL::stateful) state += m_channel;
+                        }
+                    }
+                }
+            }
+        };
+
         class WindowNode: public ArrayNode {
             size_t m_bin;
             size_t m_step;
@@ -1072,6 +1838,7 @@ namespace argos {
                 }
                 m_output_shape.push_back(channels);
                 resize(m_output_shape);
+                setTransient();
 
                 /*{
                     vector<size_t> &size = m_output_shape;
@@ -1090,7 +1857,7 @@ namespace argos {
                     size_t patch_width = m_input->data().walk<2>(packed, m_bin) - packed;
                     //std::cout << patch_width << std::endl;
                     BOOST_VERIFY(patch_width == m_output_shape.back() / m_bin);
-#pragma omp parallel for
+#pragma omp parallel for schedule(static) num_threads(parallel::threads(data().size()))
                     for (size_t i = 0; i < m_samples; ++i) {
                         Array<>::value_type const *packed_1 = m_input->data().walk<0>(packed, i);
                         Array<>::value_type *unpacked = data().walk<0>(data().addr(), i);
@@ -1130,7 +1897,7 @@ namespace argos {
                     size_t patch_width = m_input->data().walk<2>(packed, m_bin) - packed;
                     //std::cout << patch_width << std::endl;
                     BOOST_VERIFY(patch_width == m_output_shape.back() / m_bin);
-#pragma omp parallel for
+#pragma omp parallel for schedule(static) num_threads(parallel::threads(data().size()))
                     for (size_t i = 0; i < m_samples; ++i) {
                         Array<>::value_type *packed_1 = m_input->data().walk<0>(packed, i);
                         Array<>::value_type const *unpacked = delta().walk<0>(delta().addr(), i);
@@ -1168,92 +1935,281 @@ namespace argos {
             }
         };
 
+        /// Convolution, computing the same as pad + window + local linear.
+        /**
+         * Instead of materializing the whole unfolded (im2col) input, a
+         * block of output rows is unfolded at a time into a per-thread
+         * buffer small enough to stay in L2, padding is generated on the fly,
+         * and the gradient is folded back directly into the input delta.
+         * Parameters have the same layout and creation order as those of the
+         * chain, so saved models work with both implementations.
+         */
+        class ConvNode: public ArrayNode {
+            ArrayNode *m_input;
+            ParamNode *m_weight;
+            ParamNode *m_bias;
+            size_t m_pad;
+            size_t m_bin;
+            size_t m_step;
+            size_t m_samples;
+            size_t m_height;
+            size_t m_width;
+            size_t m_channel;
+            size_t m_output_height;
+            size_t m_output_width;
+            size_t m_output_channel;
+            size_t m_window;    // size of one unfolded window, bin * bin * channel
+            size_t m_block;     // output rows unfolded at a time
+
+            static constexpr size_t BLOCK_BYTES = 128 * 1024;
+
+            // Unfold output rows [r0, r0 + rows) of one sample into buf,
+            // which has one row of m_window values per output location.
+            void unfold (Array<>::value_type const *in, size_t r0, size_t rows, Array<>::value_type *buf) const {
+                for (size_t oy = r0; oy < r0 + rows; ++oy) {
+                    for (size_t ox = 0; ox < m_output_width; ++ox) {
+                        for (size_t l = 0; l < m_bin; ++l) {
+                            long iy = long(oy * m_step + l) - long(m_pad);
+                            long x0 = long(ox * m_step) - long(m_pad);
+                            size_t k0 = 0, k1 = m_bin;  // valid columns of the window row
+                            if (x0 < 0) k0 = std::min<size_t>(-x0, m_bin);
+                            if (x0 + long(m_bin) > long(m_width)) k1 = std::max<long>(long(m_width) - x0, k0);
+                            if (iy < 0 || iy >= long(m_height)) {
+                                k0 = k1 = m_bin;
+                            }
+                            std::fill(buf, buf + k0 * m_channel, 0);
+                            if (k1 > k0) {
+                                size_t ix = size_t(x0 + long(k0));
+                                Array<>::value_type const *from = in + (size_t(iy) * m_width + ix) * m_channel;
+                                std::copy(from, from + (k1 - k0) * m_channel, buf + k0 * m_channel);
+                            }
+                            std::fill(buf + k1 * m_channel, buf + m_bin * m_channel, 0);
+                            buf += m_bin * m_channel;
+                        }
+                    }
+                }
+            }
+
+            // Reverse of unfold: add unfolded gradient back to the input.
+            void fold (Array<>::value_type const *buf, size_t r0, size_t rows, Array<>::value_type *in) const {
+                for (size_t oy = r0; oy < r0 + rows; ++oy) {
+                    for (size_t ox = 0; ox < m_output_width; ++ox) {
+                        for (size_t l = 0; l < m_bin; ++l) {
+                            long iy = long(oy * m_step + l) - long(m_pad);
+                            long x0 = long(ox * m_step) - long(m_pad);
+                            if (iy >= 0 && iy < long(m_height)) {
+                                for (size_t k = 0; k < m_bin; ++k) {
+                                    long ix = x0 + long(k);
+                                    if (ix < 0 || ix >= long(m_width)) continue;
+                                    Array<>::value_type *to = in + (size_t(iy) * m_width + size_t(ix)) * m_channel;
+                                    Array<>::value_type const *from = buf + k * m_channel;
+                                    for (size_t c = 0; c < m_channel; ++c) {
+                                        to[c] += from[c];
+                                    }
+                                }
+                            }
+                            buf += m_bin * m_channel;
+                        }
+                    }
+                }
+            }
+
+            ParamNode *findOrCreateParam (Config const &config, string const &tag, size_t size, bool zero) {
+                ParamNode *param = nullptr;
+                try {
+                    param = findInputAndAdd<ParamNode>(tag, tag);
+                }
+                catch (...) {
+                }
+                if (param == nullptr) {
+                    Config pconfig = config;
+                    pconfig.put("name", name() + "_" + tag);
+                    pconfig.put("type", "param");
+                    pconfig.put("size", size);
+                    if (zero) {
+                        pconfig.put("init", 0);
+                    }
+                    pconfig.put("meta", config.get<string>("meta", "$meta"));
+                    param = model()->createNode<ParamNode>(pconfig);
+                    BOOST_VERIFY(param);
+                    addInput(param, tag);
+                }
+                BOOST_VERIFY(param->data().size() == size);
+                return param;
+            }
+        public:
+            ConvNode (Model *model, Config const &config)
+                : ArrayNode(model, config),
+                  m_pad(config.get<size_t>("pad", 0)),
+                  m_bin(config.get<size_t>("bin")),
+                  m_step(config.get<size_t>("step", 1))
+            {
+                m_input = findInputAndAdd<ArrayNode>("input", "input");
+                BOOST_VERIFY(m_input->type() == IMAGE);
+                vector<size_t> size;
+                m_input->data().size(&size);
+                BOOST_VERIFY(size.size() == 4);
+                m_samples = size[0];
+                m_height = size[1];
+                m_width = size[2];
+                m_channel = size[3];
+                BOOST_VERIFY(m_height + 2 * m_pad >= m_bin);
+                BOOST_VERIFY(m_width + 2 * m_pad >= m_bin);
+                m_output_height = 1 + (m_height + 2 * m_pad - m_bin) / m_step;
+                m_output_width = 1 + (m_width + 2 * m_pad - m_bin) / m_step;
+                m_output_channel = config.get<size_t>("channel");
+                m_window = m_bin * m_bin * m_channel;
+                m_block = std::max<size_t>(1, BLOCK_BYTES / (m_output_width * m_window * sizeof(Array<>::value_type)));
+                m_block = std::min(m_block, m_output_height);
+                setType(IMAGE);
+                resize(vector<size_t>{m_samples, m_output_height, m_output_width, m_output_channel});
+                setTransient();
+                m_weight = findOrCreateParam(config, "weight", m_window * m_output_channel, false);
+                m_bias = findOrCreateParam(config, "bias", m_output_channel, true);
+            }
+
+            void predict () {
+                data().tile(m_bias->data());
+                size_t blocks = (m_output_height + m_block - 1) / m_block;
+                size_t jobs = m_samples * blocks;
+#pragma omp parallel num_threads(parallel::threads(data().size() * m_window))
+                {
+                    vector<Array<>::value_type> buf(m_block * m_output_width * m_window);
+#pragma omp for schedule(static)
+                    for (size_t job = 0; job < jobs; ++job) {
+                        size_t s = job / blocks;
+                        size_t r0 = job % blocks * m_block;
+                        size_t rows = std::min(m_block, m_output_height - r0);
+                        size_t n = rows * m_output_width;
+                        unfold(m_input->data().at(s), r0, rows, &buf[0]);
+                        blas::gemm<Array<>::value_type>(&buf[0], n, m_window, false,
+                                   m_weight->data().addr(), m_window, m_output_channel, false,
+                                   data().at(s, r0), n, m_output_channel, 1.0, 1.0);
+                    }
+                }
+            }
+
+            void update () {
+                // Each thread works on whole samples, so folding into the
+                // input delta doesn't race, and accumulates its own weight
+                // gradient, merged at the end.
+                Array<>::value_type scale = 1.0 / m_samples;
+#pragma omp parallel num_threads(parallel::threads(data().size() * m_window))
+                {
+                    vector<Array<>::value_type> buf(m_block * m_output_width * m_window);
+                    vector<Array<>::value_type> dbuf(buf.size());
+                    vector<Array<>::value_type> wgrad(m_window * m_output_channel, 0);
+#pragma omp for schedule(static)
+                    for (size_t s = 0; s < m_samples; ++s) {
+                        for (size_t r0 = 0; r0 < m_output_height; r0 += m_block) {
+                            size_t rows = std::min(m_block, m_output_height - r0);
+                            size_t n = rows * m_output_width;
+                            Array<>::value_type const *out_delta = delta().at(s, r0);
+                            unfold(m_input->data().at(s), r0, rows, &buf[0]);
+                            blas::gemm<Array<>::value_type>(&buf[0], n, m_window, true,
+                                       out_delta, n, m_output_channel, false,
+                                       &wgrad[0], m_window, m_output_channel, 1.0, 1.0);
+                            blas::gemm<Array<>::value_type>(out_delta, n, m_output_channel, false,
+                                       m_weight->data().addr(), m_window, m_output_channel, true,
+                                       &dbuf[0], n, m_window, 1.0, 0.0);
+                            fold(&dbuf[0], r0, rows, m_input->delta().at(s));
+                        }
+                    }
+#pragma omp critical
+                    {
+                        Array<>::value_type *weight_delta = m_weight->delta().addr();
+                        for (size_t i = 0; i < wgrad.size(); ++i) {
+                            weight_delta[i] += scale * wgrad[i];
+                        }
+                    }
+                }
+                m_bias->delta().add_scaled_wrapping(scale, delta());
+            }
+        };
+
         class SoftMaxNode: public ArrayNode
         {
             ArrayNode *m_input;
+            LogPOutputNode *m_logp;     // fused loss
         public:
             SoftMaxNode (Model *model, Config const &config)
-                : ArrayNode(model, config) {
+                : ArrayNode(model, config), m_logp(nullptr) {
                 m_input = findInputAndAdd<ArrayNode>("input", "input");
                 resize(*m_input);
                 setType(m_input->type());
+                setTransientReadByUpdate();
+            }
+
+            /// Compute the gradient of logp, the only output, on the input
+            /// directly: it is the output minus 1 at the label.
+            void fuseLogP (LogPOutputNode *logp) {
+                m_logp = logp;
+                logp->fuse();
             }
 
+            // Rows are independent; the row max is subtracted before exp,
+            // which is computed in place in the output (simd::softmax).
             void predict () {
                 size_t samples = m_input->data().size(size_t(0));
                 size_t sz = m_input->data().size() / samples;
                 Array<>::value_type const *in = m_input->data().addr();
                 Array<>::value_type *out = data().addr();
-                vector<Array<>::value_type> e(sz);
+#pragma omp parallel for schedule(static) num_threads(parallel::threads(samples * sz))
                 for (size_t i = 0; i < samples; ++i) {
-                    Array<>::value_type sum = 0;
-                    for (size_t j = 0; j < sz; ++j) {
-                        e[j] = exp(in[j]);
-                        sum += e[j];
-                    }
-                    for (size_t j = 0; j < sz; ++j) {
-                        out[j] = e[j]/sum;
-                    }
-                    in += sz;
-                    out += sz;
+                    simd::softmax(in + i * sz, out + i * sz, sz);
                 }
             }
 
             void update () {
                 size_t samples = m_input->data().size(size_t(0));
                 size_t sz = m_input->data().size() / samples;
-                Array<>::value_type const *in = m_input->data().addr();
                 Array<>::value_type *in_delta = m_input->delta().addr();
                 Array<>::value_type const *out = data().addr();
                 Array<>::value_type const *out_delta = delta().addr();
 
-                //cerr << "SOFTMAX UPDATE" << endl;
-                for (;;) {
-                    if (outputs().size() != 1) break;
-                    Node *node = outputs()[0].node;
-                    LogPOutputNode *logp = dynamic_cast<LogPOutputNode *>(node);
-                    if (logp == nullptr) break;
-                    //cerr << "OPTIMIZE SOFTMAX + LOGP" << endl;
-                    vector<int> const &labels = logp->inputLabels();
+                if (m_logp) {
+                    vector<int> const &labels = m_logp->inputLabels();
                     BOOST_VERIFY(labels.size() == samples);
                     for (size_t i = 0; i < samples; ++i) {
-                        for (size_t j = 0; j < sz; ++j) {
-                            in_delta[j] += out[j];
-                        }
-                        int l = labels[i];
-                        BOOST_VERIFY(l < int(sz));
-                        BOOST_VERIFY(l >= 0);
-                        if (l < int(sz)) {
-                            in_delta[l] -= 1.0;
-                        }
-                        in_delta += sz;
-                        out += sz;
+                        BOOST_VERIFY(labels[i] >= 0);
+                        BOOST_VERIFY(labels[i] < int(sz));
+                    }
+#pragma omp parallel for schedule(static) num_threads(parallel::threads(samples * sz))
+                    for (size_t i = 0; i < samples; ++i) {
+                        Array<>::value_type *id = in_delta + i * sz;
+                        simd::add(id, out + i * sz, sz);
+                        id[labels[i]] -= 1.0;
                     }
                     return;
                 }
 
+#pragma omp parallel for schedule(static) num_threads(parallel::threads(samples * sz))
                 for (size_t i = 0; i < samples; ++i) {
+                    Array<>::value_type const *o = out + i * sz;
+                    Array<>::value_type const *od = out_delta + i * sz;
+                    Array<>::value_type *id = in_delta + i * sz;
                     Array<>::value_type sum = 0;
-                    for (unsigned j = 0; j < sz; ++j) {
-                        sum += out_delta[j] * out[j];
+                    for (size_t j = 0; j < sz; ++j) {
+                        sum += od[j] * o[j];
                     }
-                    for (unsigned j = 0; j < sz; ++j) {
-                        in_delta[j] += out[j] * (out_delta[j] - sum);
+                    for (size_t j = 0; j < sz; ++j) {
+                        id[j] += o[j] * (od[j] - sum);
                     }
-                    in += sz;
-                    in_delta += sz;
-                    out += sz;
-                    out_delta += sz;
                 }
             }
         };
 
+        /// Scales each sample to a mean square of 1, or with "location"
+        /// set, each location of an image across its channels.
         class NormalizeNode: public ArrayNode
         {
             ArrayNode *m_input;
             vector<Array<>::value_type> m_rate;
             size_t m_samples;
-            size_t m_dim;
+            bool m_location;
+            size_t m_dim;           // size of a normalized vector
+            size_t m_vectors;
+            Node const *m_fused;    // consumer that scales by the rates itself
         public:
             NormalizeNode (Model *model, Config const &config)
                 : ArrayNode(model, config) {
@@ -1261,43 +2217,75 @@ namespace argos {
                 resize(*m_input);
                 setType(m_input->type());
                 m_samples = data().size(size_t(0));
-                m_dim = data().size() / m_samples;
-                m_rate.resize(m_samples);
+                m_location = config.get<int>("location", 0) != 0;
+                if (m_location) {
+                    vector<size_t> size;
+                    data().size(&size);
+                    m_dim = size.back();    // channels are the last dimension
+                }
+                else {
+                    m_dim = data().size() / m_samples;
+                }
+                m_vectors = data().size() / m_dim;
+                m_rate.resize(m_vectors);
+                m_fused = nullptr;
+                setTransientReadByUpdate();
+            }
+
+            ArrayNode *input () const {
+                return m_input;
+            }
+            size_t samples () const {
+                return m_samples;
+            }
+            bool location () const {
+                return m_location;
+            }
+            /// Normalization rate of each sample (or location).
+            vector<Array<>::value_type> const &rates () const {
+                return m_rate;
+            }
+            /// Only compute rates(); the consumer, the only output, works
+            /// on input() and scales by the rates itself.  data() is not written.
+            void fuse (Node const *consumer) {
+                m_fused = consumer;
+                dropData();
             }
 
             void predict () {
                 Array<>::value_type const *in = m_input->data().addr();
                 Array<>::value_type *out = data().addr();
-                for (size_t i = 0; i < m_samples; ++i) {
-                    Array<>::value_type sum = 0;
-                    for (size_t j = 0; j < m_dim; ++j) {
-                        sum += in[j] * in[j];;
-                    }
-                    Array<>::value_type r = 1.0 / sqrt(sum / m_dim);
+                size_t n = m_dim;
+#pragma omp parallel for schedule(static) num_threads(parallel::threads(m_vectors * n))
+                for (size_t i = 0; i < m_vectors; ++i) {
+                    Array<>::value_type const *x = in + i * n;
+                    Array<>::value_type r = 1.0 / sqrt(simd::sumsq(x, n) / n);
                     m_rate[i] = r;
-                    for (size_t j = 0; j < m_dim; ++j) {
-                        out[j] = in[j] * r;
+                    if (!m_fused) {
+                        Array<>::value_type *y = out + i * n;
+                        std::copy(x, x + n, y);
+                        simd::scale(y, r, n);
                     }
-                    in += m_dim;
-                    out += m_dim;
                 }
             }
 
             void update () {
                 Array<>::value_type const *in = m_input->data().addr();
                 Array<>::value_type *in_delta = m_input->delta().addr();
-                Array<>::value_type const *out = data().addr();
                 Array<>::value_type const *out_delta = delta().addr();
-                for (size_t i = 0; i < m_samples; ++i) {
-                    for (size_t j = 0; j < m_dim; ++j) {
-                        in_delta[j] = out_delta[j] * m_rate[i] * (1.0 - out[j] * out[j] / m_dim);
-                    }
+                size_t n = m_dim;
+#pragma omp parallel for schedule(static) num_threads(parallel::threads(m_vectors * n))
+                for (size_t i = 0; i < m_vectors; ++i) {
+                    simd::norm_delta(in_delta + i * n, out_delta + i * n, in + i * n, m_rate[i], n);
+                }
+            }
 
-                    in += m_dim;
-                    out += m_dim;
-                    in_delta += m_dim;
-                    out_delta += m_dim;
+            void report (ostream &os) const {
+                if (m_fused) {
+                    os << name() << ":\tfused into " << m_fused->name() << endl;
+                    return;
                 }
+                ArrayNode::report(os);
             }
         };
 
@@ -1310,9 +2298,10 @@ namespace argos {
             size_t m_samples;
             size_t m_sample_size;
             size_t m_cnt;
+            Model::Random m_random;
         public:
             DropOutNode (Model *model, Config const &config)
-                : ArrayNode(model, config) {
+                : ArrayNode(model, config), m_random(model->random()()) {
                 m_input = findInputAndAdd<ArrayNode>("input", "input");
                 m_rate = config.get<double>("rate", 0.5);
                 m_freq = config.get<double>("freq", 1);
@@ -1327,11 +2316,12 @@ namespace argos {
                 for (size_t i = 0; i < nz; ++i) {
                     m_mask[i] = 1.0;
                 }
+                setTransient();
             }
 
             void predict () {
                 if (mode() == MODE_PREDICT) {
-#pragma omp parallel for
+#pragma omp parallel for schedule(static) num_threads(parallel::threads(m_samples * m_sample_size))
                     for (size_t i = 0; i < m_samples; ++i) {
                         Array<>::value_type const *in = m_input->data().at(i);
                         Array<>::value_type *out = data().at(i);
@@ -1342,10 +2332,10 @@ namespace argos {
                 }
                 else {
                     if (m_cnt % m_freq == 0) {
-                        random_shuffle(m_mask.begin(), m_mask.end());
+                        std::shuffle(m_mask.begin(), m_mask.end(), m_random);
                     }
                     ++m_cnt;
-#pragma omp parallel for
+#pragma omp parallel for schedule(static) num_threads(parallel::threads(m_samples * m_sample_size))
                     for (size_t i = 0; i < m_samples; ++i) {
                         Array<>::value_type const *in = m_input->data().at(i);
                         Array<>::value_type *out = data().at(i);
@@ -1358,7 +2348,7 @@ namespace argos {
             }
 
             void update () {
-#pragma omp parallel for
+#pragma omp parallel for schedule(static) num_threads(parallel::threads(m_samples * m_sample_size))
                 for (size_t i = 0; i < m_samples; ++i) {
                     Array<>::value_type *in = m_input->delta().at(i);
                     Array<>::value_type const *out = delta().at(i);
@@ -1368,6 +2358,66 @@ namespace argos {
                 }
             }
         };
+
+        /// Rewrites fusing core nodes, registered in register.cpp.
+        namespace fusion {
+
+            /// linear: bias added to the gemm output, block by block of rows,
+            /// instead of the output being tiled with bias before gemm.  Only
+            /// for blocked (local, narrow output, many rows) linears, where
+            /// the blocks' epilogue saves passes over the output; elsewhere
+            /// the tiled bias is added by gemm itself.
+            struct LinearBias: public Rewrite {
+                bool apply (Node *node) const {
+                    LinearNode *linear = dynamic_cast<LinearNode *>(node);
+                    if (linear == nullptr || !linear->blocked()) return false;
+                    linear->fuseBias();
+                    return true;
+                }
+            };
+
+            /// norm + linear: linear multiplies the input of norm and
+            /// scales its output rows by the rates; norm only computes them.
+            struct NormalizeLinear: public Rewrite {
+                bool apply (Node *node) const {
+                    NormalizeNode *norm = dynamic_cast<NormalizeNode *>(node);
+                    if (norm == nullptr || norm->location() || norm->outputs().size() != 1) return false;
+                    LinearNode *linear = dynamic_cast<LinearNode *>(norm->outputs()[0].node);
+                    if (linear == nullptr || linear->input() != norm) return false;
+                    if (linear->sparse() || linear->local()) return false;
+                    if (linear->data().size(size_t(0)) != norm->samples()) return false;
+                    linear->fuseRowScale(norm->input(), &norm->rates());
+                    norm->fuse(linear);
+                    return true;
+                }
+            };
+
+            /// linear + in-place function (relu, tanh...): linear applies
+            /// the function to its output, which the function node shares.
+            struct LinearActivation: public Rewrite {
+                bool apply (Node *node) const {
+                    LinearNode *linear = dynamic_cast<LinearNode *>(node);
+                    if (linear == nullptr || linear->outputs().size() != 1) return false;
+                    ActivationNode *act = dynamic_cast<ActivationNode *>(linear->outputs()[0].node);
+                    if (act == nullptr || act->input() != linear || act->forward() == nullptr) return false;
+                    linear->fuseActivation(act->forward());
+                    act->fuse();
+                    return true;
+                }
+            };
+
+            /// softmax + logp: softmax computes the gradient of the loss.
+            struct SoftMaxLogP: public Rewrite {
+                bool apply (Node *node) const {
+                    SoftMaxNode *softmax = dynamic_cast<SoftMaxNode *>(node);
+                    if (softmax == nullptr || softmax->outputs().size() != 1) return false;
+                    LogPOutputNode *logp = dynamic_cast<LogPOutputNode *>(softmax->outputs()[0].node);
+                    if (logp == nullptr) return false;
+                    softmax->fuseLogP(logp);
+                    return true;
+                }
+            };
+        }
     }
 }
 #endif
@@ -114,6 +114,7 @@ namespace argos {
         public:
             DataNode (Model *model, Config const &config) 
                 : ArrayNode(model, config), m_done(false),
+                m_random(model->random()()),
                 m_noise_level(config.get<double>("noise", 0)),
                 m_margin(config.get<double>("margin", 0)
                 
@@ -154,8 +155,6 @@ namespace argos {
 
                     vector<size_t> sz{m_rows.size(), m_do_exp * m_cols_exp.size() + m_do_copy * m_cols_copy.size()};
                     data().resize(sz);
-                    delta().resize(sz);
-                    delta().fill(0.0);
                     for (unsigned i = 0; i < m_rows.size(); ++i) {
                         Array<>::value_type *x = data().at(i);
                         unsigned j = 0;
@@ -176,7 +175,7 @@ namespace argos {
 
                     if (logscale) {
                         BOOST_VERIFY(!m_do_copy);
-                        data().apply([](double &y){y = (std::log(y) - 1.0) / 1.75;});
+                        data().apply([](real_t &y){y = (std::log(y) - 1.0) / 1.75;});
                     }
                 }
                 else {
@@ -188,11 +187,11 @@ namespace argos {
 
                     if (logscale) {
                         BOOST_VERIFY(!m_do_copy);
-                        m_exp.apply([](double &y){y = (std::log(y) - 1.0) / 1.75;});
+                        m_exp.apply([](real_t &y){y = (std::log(y) - 1.0) / 1.75;});
                     }
 
                     unsigned batch = getConfig<unsigned>("batch", "argos.global.batch");
-                    role::BatchInput::init(batch, m_rows.size(), mode());
+                    role::BatchInput::init(batch, m_rows.size(), mode(), 0, model->random());
 
                     vector<size_t> sz{batch, m_do_exp * m_cols_exp.size() + m_do_copy * m_cols_copy.size()};
                     data().resize(sz);
@@ -329,11 +328,11 @@ namespace argos {
 
             }
 
-            virtual Array<double> const &labels () const {
+            virtual Array<> const &labels () const {
                 return m_target;
             }
 
-            virtual Array<double> const &margins () const {
+            virtual Array<> const &margins () const {
                 return m_margins;
             }
 
@@ -1,6 +1,12 @@
 #ifndef ARGOS_NODE_IMAGE
 #define ARGOS_NODE_IMAGE
 
+#include <exception>
+#include <mutex>
+#include <deque>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <boost/lexical_cast.hpp>
 #include <jpeglib.h>
 #include <opencv/cv.h>
@@ -12,59 +18,103 @@ namespace argos {
         using namespace boost;
         typedef cv::Mat Image;
 
-        static void decompress_error_exit (j_common_ptr ptr) {
-            j_decompress_ptr cinfo = reinterpret_cast<j_decompress_ptr>(ptr);
-            char msg[JMSG_LENGTH_MAX];
-            (*cinfo->err->format_message)(ptr, msg);
-            jpeg_destroy_decompress(cinfo);
-            LOG(error) << msg;
-            throw runtime_error(msg);
-        }
-
-        Image imread_jpeg (const std::string &path) {
-            struct jpeg_decompress_struct cinfo;
-            struct jpeg_error_mgr jerr;
-            cinfo.err = jpeg_std_error(&jerr);
-            jerr.error_exit = decompress_error_exit;
-            jpeg_create_decompress(&cinfo);
-
-            FILE *infile = fopen(path.c_str(), "rb");
-            if (infile == NULL) throw runtime_error("cannot open file: " + path);
-
-            jpeg_stdio_src(&cinfo, infile);
-
-            jpeg_read_header(&cinfo, TRUE);
-            // if only meta data is needed, goto  shortcut
-
-            //cinfo.out_color_space
-            // set out_color_space
-
-            jpeg_start_decompress(&cinfo);
+        /// Reusable JPEG decoder.
+        /**
+         * The file is read into memory and decoded from there.  If a minimal
+         * size is given, libjpeg decodes at 1/2, 1/4 or 1/8 scale (DCT
+         * scaling, much cheaper than full decoding) as long as the result
+         * is still at least that large.  A decoder is not thread-safe; use one
+         * per thread.
+         */
+        class JpegDecoder {
+            struct jpeg_decompress_struct m_cinfo;
+            struct jpeg_error_mgr m_jerr;
+            vector<char> m_buffer;
+            unsigned m_min_height;
+            unsigned m_min_width;
+
+            static void error_exit (j_common_ptr ptr) {
+                char msg[JMSG_LENGTH_MAX];
+                (*ptr->err->format_message)(ptr, msg);
+                throw runtime_error(msg);
+            }
 
-            if ((cinfo.output_components != 3) && (cinfo.output_components != 1)) throw runtime_error("must be color or gray image");
+            Image decode () {
+                jpeg_mem_src(&m_cinfo, reinterpret_cast<unsigned char *>(&m_buffer[0]), m_buffer.size());
+                jpeg_read_header(&m_cinfo, TRUE);
+                m_cinfo.scale_num = 1;
+                m_cinfo.scale_denom = 1;
+                if (m_min_height > 0 || m_min_width > 0) {
+                    unsigned denom = 1;
+                    while (denom < 8) {
+                        unsigned d = denom * 2;
+                        if ((m_cinfo.image_height + d - 1) / d < m_min_height) break;
+                        if ((m_cinfo.image_width + d - 1) / d < m_min_width) break;
+                        denom = d;
+                    }
+                    m_cinfo.scale_denom = denom;
+                }
+                jpeg_start_decompress(&m_cinfo);
+                if ((m_cinfo.output_components != 3) && (m_cinfo.output_components != 1)) {
+                    throw runtime_error("must be color or gray image");
+                }
+                Image image(m_cinfo.output_height, m_cinfo.output_width, CV_8UC3);
+                JSAMPROW row_pointer[1] = {reinterpret_cast<unsigned char *>(image.data)};
+                while (m_cinfo.output_scanline < m_cinfo.output_height) {
+                    jpeg_read_scanlines(&m_cinfo, row_pointer, 1);
+                    if (m_cinfo.output_components == 1) {
+                        JSAMPROW p = row_pointer[0];
+                        unsigned i = image.cols - 1;
+                        for (;;) {
+                            unsigned i3 = i * 3;
+                            p[i3] = p[i3+1] = p[i3+2] = p[i];
+                            if (i == 0) break;
+                            --i;
+                        }
+                    }
+                    row_pointer[0] += image.step[0];
+                }
+                jpeg_finish_decompress(&m_cinfo);
+                return image;
+            }
+        public:
+            JpegDecoder (): m_min_height(0), m_min_width(0) {
+                m_cinfo.err = jpeg_std_error(&m_jerr);
+                m_jerr.error_exit = error_exit;
+                jpeg_create_decompress(&m_cinfo);
+            }
 
-            LOG(trace) << "READ " << path;
-            Image image(cinfo.output_height, cinfo.output_width, CV_8UC3);
+            ~JpegDecoder () {
+                jpeg_destroy_decompress(&m_cinfo);
+            }
 
-            JSAMPROW row_pointer[1] = {reinterpret_cast<unsigned char *>(image.data)};
-            while (cinfo.output_scanline < cinfo.output_height) {
-                jpeg_read_scanlines(&cinfo,row_pointer,1);
-                if (cinfo.output_components == 1) {
-                    JSAMPROW p = row_pointer[0];
-                    unsigned i = image.cols - 1;
-                    for (;;) {
-                        unsigned i3 = i * 3;
-                        p[i3] = p[i3+1] = p[i3+2] = p[i];
-                        if (i == 0) break;
-                        --i;
-                    }
+            Image decode (string const &path, unsigned min_height = 0, unsigned min_width = 0) {
+                {
+                    ifstream is(path.c_str(), ios::binary);
+                    if (!is) throw runtime_error("cannot open file: " + path);
+                    is.seekg(0, ios::end);
+                    m_buffer.resize(is.tellg());
+                    is.seekg(0, ios::beg);
+                    is.read(&m_buffer[0], m_buffer.size());
+                    if (!is) throw runtime_error("cannot read file: " + path);
+                }
+                LOG(trace) << "READ " << path;
+                m_min_height = min_height;
+                m_min_width = min_width;
+                try {
+                    return decode();
+                }
+                catch (...) {
+                    jpeg_abort_decompress(&m_cinfo);    // ready for next image
+                    LOG(error) << "failed to decode " << path;
+                    throw;
                 }
-                row_pointer[0] += image.step[0];
             }
-            jpeg_finish_decompress(&cinfo);
-            jpeg_destroy_decompress(&cinfo);
-            fclose(infile);
-            return image;
+        };
+
+        Image imread_jpeg (const std::string &path, unsigned min_height = 0, unsigned min_width = 0) {
+            static thread_local JpegDecoder decoder;
+            return decoder.decode(path, min_height, min_width);
         }
 
         static void compress_error_exit (j_common_ptr ptr) {
@@ -79,7 +129,7 @@ namespace argos {
             throw runtime_error(msg);
         }
 
-        void EncodeJPEG (double const *data,
+        void EncodeJPEG (real_t const *data,
                          unsigned width, unsigned height, unsigned channel,
                          std::string *buffer,
                          int quality = 80) {
@@ -179,10 +229,10 @@ namespace argos {
 
             void predict () {
                 //if (mode() == MODE_PREDICT) {
-                    Array<double> const &array = m_input->data();
+                    Array<> const &array = m_input->data();
                     vector<size_t> sz;
                     array.size(&sz);
-                    double const *data = array.addr();
+                    real_t const *data = array.addr();
                     for (unsigned i = 0; i < sz[0]; ++i) {
                         string jpeg;
                         EncodeJPEG(data, sz[2], sz[1], sz[3], &jpeg);
@@ -197,6 +247,129 @@ namespace argos {
             //}
         };
 
+        /// Cache of decoded images.
+        /**
+         * Images are kept as packed 8-bit RGB in a ring buffer of fixed
+         * size, either anonymous memory or a memory-mapped file (e.g. on a
+         * local disk, the file is unlinked right away and only lives as long
+         * as the cache).  When full, the oldest images are evicted first.
+         * If a size is given, images are resized before being cached.
+         * Lookups return copies, so an image stays valid after eviction.
+         * Thread-safe.
+         */
+        class ImageCache {
+            struct Entry {
+                size_t offset;
+                int rows;
+                int cols;
+            };
+            std::mutex m_lock;
+            size_t m_budget;
+            char *m_arena;
+            size_t m_head;      // where the next image goes
+            size_t m_used;      // bytes held by cached images
+            unsigned m_height;  // 0 for no resizing
+            unsigned m_width;
+            map<string, Entry> m_entries;
+            deque<map<string, Entry>::iterator> m_fifo;  // oldest first
+            size_t m_hits;
+            size_t m_misses;
+
+            static size_t bytes (Entry const &e) {
+                return size_t(e.rows) * e.cols * 3;
+            }
+
+            void evictOldest () {
+                m_used -= bytes(m_fifo.front()->second);
+                m_entries.erase(m_fifo.front());
+                m_fifo.pop_front();
+            }
+
+            void insert (string const &path, Image const &image) {
+                Entry e{0, image.rows, image.cols};
+                size_t size = bytes(e);
+                if (size > m_budget || m_entries.count(path)) return;
+                if (m_head + size > m_budget) {
+                    // wrap around, images after head are the oldest
+                    while (!m_fifo.empty() && m_fifo.front()->second.offset >= m_head) {
+                        evictOldest();
+                    }
+                    m_head = 0;
+                }
+                while (!m_fifo.empty() && m_fifo.front()->second.offset >= m_head
+                                       && m_fifo.front()->second.offset < m_head + size) {
+                    evictOldest();
+                }
+                e.offset = m_head;
+                m_head += size;
+                m_used += size;
+                char *to = m_arena + e.offset;
+                size_t row = size_t(image.cols) * 3;
+                for (int y = 0; y < image.rows; ++y) {
+                    unsigned char const *from = image.data + y * image.step[0];
+                    std::copy(from, from + row, to);
+                    to += row;
+                }
+                m_fifo.push_back(m_entries.insert(make_pair(path, e)).first);
+            }
+        public:
+            ImageCache (size_t budget, string const &path, unsigned height, unsigned width)
+                : m_budget(budget), m_arena(nullptr), m_head(0), m_used(0),
+                m_height(height), m_width(width), m_hits(0), m_misses(0)
+            {
+                void *ptr = MAP_FAILED;
+                if (path.empty()) {
+                    ptr = mmap(nullptr, m_budget, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                }
+                else {
+                    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+                    if (fd < 0) throw runtime_error("cannot create image cache " + path);
+                    unlink(path.c_str());
+                    if (ftruncate(fd, m_budget) == 0) {
+                        ptr = mmap(nullptr, m_budget, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                    }
+                    close(fd);
+                }
+                if (ptr == MAP_FAILED) throw runtime_error("cannot allocate image cache");
+                m_arena = static_cast<char *>(ptr);
+            }
+
+            ~ImageCache () {
+                munmap(m_arena, m_budget);
+            }
+
+            /// Return the cached image of path, or call load to get it and cache it.
+            Image get (string const &path, function<Image()> const &load) {
+                {
+                    std::lock_guard<std::mutex> lock(m_lock);
+                    auto it = m_entries.find(path);
+                    if (it != m_entries.end()) {
+                        Entry const &e = it->second;
+                        Image image(e.rows, e.cols, CV_8UC3);
+                        std::copy(m_arena + e.offset, m_arena + e.offset + bytes(e), image.data);
+                        ++m_hits;
+                        return image;
+                    }
+                    ++m_misses;
+                }
+                Image image = load();
+                if (m_height > 0 && m_width > 0) {
+                    Image resized;
+                    cv::resize(image, resized, cv::Size(m_width, m_height), 0, 0, cv::INTER_AREA);
+                    image = resized;
+                }
+                std::lock_guard<std::mutex> lock(m_lock);
+                insert(path, image);
+                return image;
+            }
+
+            void report (ostream &os) {
+                std::lock_guard<std::mutex> lock(m_lock);
+                os << "cache:\timages/" << m_entries.size() << "\tused/" << m_used
+                   << "\thits/" << m_hits << "\tmisses/" << m_misses << endl;
+            }
+        };
+
         class ImageNode: public Node {
         protected:
             vector<Image> m_images;
@@ -212,9 +385,55 @@ namespace argos {
             vector<pair<int,string>> m_paths;
             // labels of the batch
             vector<int> m_labels;
+            // prefetch slots
+            vector<vector<Image>> m_slot_images;
+            vector<vector<int>> m_slot_labels;
+
+            // decode at reduced scale while images stay at least this large
+            unsigned m_min_height;
+            unsigned m_min_width;
+            unique_ptr<ImageCache> m_cache;
+
+            void loadBatch (unsigned slot, vector<unsigned> const &index) {
+                vector<Image> &images = (slot == CURRENT) ? m_images : m_slot_images[slot];
+                vector<int> &labels = (slot == CURRENT) ? m_labels : m_slot_labels[slot];
+                images.resize(index.size());
+                labels.clear();
+                for (unsigned i: index) {
+                    labels.push_back(m_paths[i].first);
+                }
+                LOG(trace) << "LOADING IMAGES...";
+                std::exception_ptr error;
+#pragma omp parallel for schedule(dynamic)
+                for (size_t k = 0; k < index.size(); ++k) {
+                    try {
+                        string const &path = m_paths[index[k]].second;
+                        if (m_cache) {
+                            images[k] = m_cache->get(path, [this, &path]() {
+                                return imread_jpeg(path, m_min_height, m_min_width);
+                            });
+                        }
+                        else {
+                            images[k] = imread_jpeg(path, m_min_height, m_min_width);
+                        }
+                    }
+                    catch (...) {
+#pragma omp critical
+                        error = std::current_exception();
+                    }
+                }
+                if (error) std::rethrow_exception(error);
+            }
+
+            void swapBatch (unsigned slot) {
+                m_images.swap(m_slot_images[slot]);
+                m_labels.swap(m_slot_labels[slot]);
+            }
         public:
             ImageInputNode (Model *model, Config const &config) 
-                : ImageNode(model, config)
+                : ImageNode(model, config),
+                m_min_height(config.get<unsigned>("min_height", 0)),
+                m_min_width(config.get<unsigned>("min_width", 0))
             {
                 string path;
                 if (mode() == MODE_PREDICT) {
@@ -232,17 +451,33 @@ namespace argos {
                         m_paths.push_back(make_pair(l, std::move(p)));
                     }
                 }
-                role::BatchInput::init(getConfig<unsigned>("batch", "argos.global.batch"), m_paths.size(), mode());
+                unsigned prefetch = getConfig<unsigned>("prefetch", "argos.global.prefetch", 0);
+                role::BatchInput::init(getConfig<unsigned>("batch", "argos.global.batch"), m_paths.size(), mode(), prefetch, model->random());
+                m_slot_images.resize(prefetch);
+                m_slot_labels.resize(prefetch);
+                // cache size in MB
+                size_t cache = getConfig<size_t>("cache.size", "argos.global.image_cache", 0);
+                if (cache > 0) {
+                    m_cache = unique_ptr<ImageCache>(new ImageCache(cache << 20,
+                                config.get<string>("cache.path", ""),
+                                config.get<unsigned>("cache.height", 0),
+                                config.get<unsigned>("cache.width", 0)));
+                }
+            }
+
+            ~ImageInputNode () {
+                role::BatchInput::stop();
+            }
+
+            void report (ostream &os) const {
+                if (m_cache) {
+                    os << name() << ":\t";
+                    m_cache->report(os);
+                }
             }
 
             void predict () {
-                m_labels.clear();
-                m_images.clear();
-                LOG(trace) << "LOADING IMAGES...";
-                role::BatchInput::next([this](unsigned i) {
-                        m_labels.push_back(m_paths[i].first);
-                        m_images.push_back(imread_jpeg(m_paths[i].second));
-                });
+                role::BatchInput::fetch();
             }
 
             virtual vector<int> const &labels () const {
@@ -256,6 +491,7 @@ namespace argos {
             unsigned m_width;
             unsigned m_mirror;
             unsigned m_fix;
+            Model::Random m_random;
         public:
             ImageSampleNode (Model *model, Config const &config) 
                 : core::ArrayNode(model, config),
@@ -263,7 +499,8 @@ namespace argos {
                 m_height(config.get<unsigned>("height", 227)),
                 m_width(config.get<unsigned>("width", 227)),
                 m_mirror(config.get<unsigned>("mirror", 1)),
-                m_fix(config.get<unsigned>("fix", 0))
+                m_fix(config.get<unsigned>("fix", 0)),
+                m_random(model->random()())
             {
                 BOOST_VERIFY(m_input);
                 vector<size_t> size{m_input->batch(), m_width, m_height, 3};
@@ -273,11 +510,11 @@ namespace argos {
 
             void predict () {
                 vector<Image> const &images = m_input->images();
-                double *out = data().addr();
+                real_t *out = data().addr();
                 for (unsigned i = 0; i < images.size(); ++i) {
                     Image const &image = images[i];
-                    unsigned yoff = rand() % (image.rows - m_height + 1);
-                    unsigned xoff = rand() % (image.cols - m_width + 1);
+                    unsigned yoff = m_random() % (image.rows - m_height + 1);
+                    unsigned xoff = m_random() % (image.cols - m_width + 1);
                     if (m_fix) {
                         yoff = 0;
                         xoff = 0;
@@ -3,6 +3,7 @@
 #include <fstream>
 #include <sstream>
 #include <algorithm>
+#include "io.h"
 
 namespace argos {
     namespace utils {
@@ -35,17 +36,65 @@ namespace argos {
             }
         };
 
+        /// Input in libsvm format.
+        /**
+         * Keys: "dim", "train" and "test" (the data files), "batch",
+         * "prefetch".  With "sparse", batches are produced as CSR rows
+         * instead of a dense batch x dim array (see role::SparseActivation).
+         * With "cache", the parsed data are saved to <data file>.cache,
+         * next to the data, and loaded from there in later runs as long
+         * as the data file is unchanged; off by default.
+         */
         template <typename T = int>
-        class LibSvmInputNode: public ArrayNode, public role::LabelInput<T>, public role::BatchInput {
+        class LibSvmInputNode: public ArrayNode, public role::LabelInput<T>, public role::BatchInput, public role::SparseActivation {
             size_t m_dim;
-            vector<T> m_all_labels;
-            vector<vector<pair<unsigned, double>>> m_data;
-            vector<unsigned> m_index;
+            bool m_sparse;
+            io::LibSvmDataSet<T> m_examples;
             vector<T> m_labels;
+            SparseArray<> m_rows;
+            // prefetch slots
+            vector<Array<>> m_slot_data;
+            vector<vector<T>> m_slot_labels;
+            vector<SparseArray<>> m_slot_rows;
+
+            void loadBatch (unsigned slot, vector<unsigned> const &index) {
+                vector<T> &labels = (slot == this->CURRENT) ? m_labels : m_slot_labels[slot];
+                labels.clear();
+                for (unsigned i: index) {
+                    labels.push_back(m_examples.labels()[i]);
+                }
+                if (m_sparse) {
+                    SparseArray<> &rows = (slot == this->CURRENT) ? m_rows : m_slot_rows[slot];
+                    rows.clear();
+                    for (unsigned i: index) {
+                        rows.appendRow(m_examples.rows(), i);
+                    }
+                    return;
+                }
+                Array<> &array = (slot == this->CURRENT) ? data() : m_slot_data[slot];
+                array.fill(0.0);
+                Array<>::value_type *x = array.addr();
+                for (unsigned i: index) {
+                    m_examples.rows().expand(i, x);
+                    x += m_dim;
+                }
+            }
+
+            void swapBatch (unsigned slot) {
+                if (m_sparse) {
+                    m_rows.swap(m_slot_rows[slot]);
+                }
+                else {
+                    data().swap(m_slot_data[slot]);
+                }
+                m_labels.swap(m_slot_labels[slot]);
+            }
         public:
             LibSvmInputNode (Model *model, Config const &config)
                 : ArrayNode(model, config),
-                m_dim(config.get<unsigned>("dim"))
+                m_dim(config.get<unsigned>("dim")),
+                m_sparse(config.get<int>("sparse", 0) != 0),
+                m_rows(m_dim)
             {
                 string path;
                 if (mode() == MODE_PREDICT) {
@@ -56,51 +105,120 @@ namespace argos {
                 }
 
                 LOG(info) << "loading " << path;
-                ifstream is(path.c_str());
-                string line;
-                while (getline(is, line)) {
-                    istringstream ss(line);
-                    T l;
-                    unsigned d;
-                    char dummy;
-                    double v;
-                    ss >> l;
-                    if (!ss) continue;
-                    m_all_labels.push_back(l);
-                    m_data.push_back(vector<pair<unsigned, double>>());
-                    auto &back = m_data.back();
-                    while (ss >> d >> dummy >> v) {
-                        BOOST_VERIFY(dummy == ':');
-                        back.push_back(make_pair(d - 1, v));
-                        BOOST_VERIFY(d <= m_dim);
-                    }
+                // binary cache next to the data, skips parsing in later runs
+                string cache;
+                if (config.get<int>("cache", 0) != 0) {
+                    cache = path + ".cache";
                 }
-                role::BatchInput::init(getConfig<unsigned>("batch", "argos.global.batch"), m_all_labels.size(), mode());
+                m_examples.load(path, m_dim, cache);
+                unsigned prefetch = getConfig<unsigned>("prefetch", "argos.global.prefetch", 0);
+                role::BatchInput::init(getConfig<unsigned>("batch", "argos.global.batch"), m_examples.size(), mode(), prefetch, model->random());
                 LOG(debug) << "dim: " << m_dim;
                 vector<size_t> size{batch(), m_dim};
-                resize(size);
                 setType(FLAT);
+                m_slot_labels.resize(prefetch);
+                if (m_sparse) {
+                    reshape(size);
+                    m_slot_rows.resize(prefetch, m_rows);
+                    return;
+                }
+                resize(size);
+                m_slot_data.resize(prefetch);
+                for (auto &array: m_slot_data) {
+                    array.resize(size);
+                }
+            }
+
+            ~LibSvmInputNode () {
+                role::BatchInput::stop();
             }
 
             void predict () {
-                data().fill(0.0);
-                m_labels.clear(); //resize(m_batch);
-                Array<>::value_type *x = data().addr();
-                role::BatchInput::next([this, &x](unsigned i) {
-                    m_labels.push_back(m_all_labels[i]);
-                    for (auto p: m_data[i]) {
-                        if (p.first >= m_dim) {
-                            LOG(error) << "dim exceeds range: " << p.first;
-                        }
-                        x[p.first] = p.second;
-                    }
-                    x += m_dim;
-                });
+                role::BatchInput::fetch();
             }
 
             virtual vector<T> const &labels () const {
                 return m_labels;
             }
+
+            virtual bool isSparse () const {
+                return m_sparse;
+            }
+
+            virtual SparseArray<> const &sparse () const {
+                return m_rows;
+            }
+        };
+
+        /// Input from a packed dataset (see io.h).
+        /**
+         * The shape of the node is the batch size followed by the shape of
+         * one example in the file.  8-bit data are mapped to [-1, 1].
+         * The first label of each example is the label.
+         */
+        class PackedInputNode: public ArrayNode, public role::LabelInput<int>, public role::BatchInput {
+            io::PackedDataSet m_examples;
+            vector<int> m_labels;
+            // prefetch slots
+            vector<Array<>> m_slot_data;
+            vector<vector<int>> m_slot_labels;
+
+            void loadBatch (unsigned slot, vector<unsigned> const &index) {
+                Array<> &array = (slot == CURRENT) ? data() : m_slot_data[slot];
+                vector<int> &labels = (slot == CURRENT) ? m_labels : m_slot_labels[slot];
+                array.fill(0.0);
+                labels.clear();
+                Array<>::value_type *x = array.addr();
+                for (unsigned i: index) {
+                    labels.push_back(m_examples.header().labels ? m_examples.label(i) : 0);
+                    io::unpack(m_examples.header(), m_examples.example(i), x);
+                    x = array.walk<0>(x);
+                }
+            }
+
+            void swapBatch (unsigned slot) {
+                data().swap(m_slot_data[slot]);
+                m_labels.swap(m_slot_labels[slot]);
+            }
+        public:
+            PackedInputNode (Model *model, Config const &config)
+                : ArrayNode(model, config)
+            {
+                string path;
+                if (mode() == MODE_PREDICT) {
+                    path = config.get<string>("test");
+                }
+                else {
+                    path = config.get<string>("train");
+                }
+                LOG(info) << "mapping " << path;
+                m_examples.load(path);
+                unsigned prefetch = getConfig<unsigned>("prefetch", "argos.global.prefetch", 0);
+                role::BatchInput::init(getConfig<unsigned>("batch", "argos.global.batch"), m_examples.size(), mode(), prefetch, model->random());
+                vector<size_t> size{batch()};
+                for (size_t d: m_examples.shape()) {
+                    size.push_back(d);
+                }
+                resize(size);
+                setType(size.size() == 4 ? IMAGE : FLAT);
+                m_slot_data.resize(prefetch);
+                for (auto &array: m_slot_data) {
+                    array.resize(size);
+                }
+                m_slot_labels.resize(prefetch);
+            }
+
+            ~PackedInputNode () {
+                role::BatchInput::stop();
+            }
+
+            void predict () {
+                role::BatchInput::fetch();
+            }
+
+            virtual vector<int> const &labels () const {
+                return m_labels;
+            }
         };
 
         /// The node evaluates the model periodically in training mode.
@@ -142,7 +260,7 @@ namespace argos {
             void prepare (Plan *plan) {
                 if (mode() == MODE_TRAIN) {
                     // add preupdate task
-                    auto deps = plan->add(this, TASK_UPDATE, std::bind(&Node::update, dynamic_cast<Node *>(this)));
+                    auto deps = plan->add(this, TASK_UPDATE, &Plan::invoke<Node, &Node::update>, static_cast<Node *>(this));
                     deps.add(m_root, TASK_UPDATE);
                 }
             }
@@ -192,18 +310,21 @@ namespace argos {
                 auto &acc0 = acc(0);
                 auto &acc1 = acc(1);
                 Array<>::value_type const *x = m_input->data().addr();
-                Array<>::value_type *dx = m_input->delta().addr();
                 size_t sz = m_input->data().size();
-                BOOST_VERIFY(sz == m_input->delta().size());
                 for (size_t i = 0; i < sz; ++i) {
                     acc0(x[i]);
+                }
+                if (!m_input->hasDelta()) return;
+                Array<>::value_type const *dx = m_input->delta().addr();
+                BOOST_VERIFY(sz == m_input->delta().size());
+                for (size_t i = 0; i < sz; ++i) {
                     acc1(dx[i]);
                 }
             }
 
             void prepare (Plan *plan) {
                 Node::prepare(plan);
-                auto r = plan->add(this, TASK_USER, std::bind(&ArrayStat::doStat, this));
+                auto r = plan->add(this, TASK_USER, &Plan::invoke<ArrayStat, &ArrayStat::doStat>, this);
                 switch (mode()) {
                     case MODE_TRAIN:
                         r.add(m_input, TASK_UPDATE);
@@ -0,0 +1,113 @@
+#include <cstdint>
+#include <iostream>
+#include <sstream>
+#include <boost/program_options.hpp>
+#include "io.h"
+
+using namespace std;
+namespace po = boost::program_options;
+
+using namespace argos;
+
+// CIFAR binary format: one or two label bytes followed by 3x32x32 pixels,
+// channel by channel.  Pixels are reordered to 32x32x3.
+static void pack_cifar (vector<string> const &inputs, unsigned labels, io::PackedWriter *writer) {
+    size_t constexpr AREA = 32 * 32;
+    size_t constexpr CHANNELS = 3;
+    vector<uint8_t> record(labels + AREA * CHANNELS);
+    vector<uint8_t> pixels(AREA * CHANNELS);
+    vector<int32_t> l(labels);
+    for (string const &path: inputs) {
+        ifstream is(path.c_str(), ios::binary);
+        if (!is) throw runtime_error("cannot open " + path);
+        while (is.read((char *)&record[0], record.size())) {
+            for (unsigned i = 0; i < labels; ++i) {
+                l[i] = record[i];
+            }
+            uint8_t const *p = &record[labels];
+            for (unsigned j = 0; j < CHANNELS; ++j) {
+                for (unsigned k = 0; k < AREA; ++k) {
+                    pixels[k * CHANNELS + j] = p[j * AREA + k];
+                }
+            }
+            writer->add(&pixels[0], &l[0]);
+        }
+        if (is.gcount() != 0) throw runtime_error(path + ": truncated record");
+    }
+}
+
+// Dense text format: one example per line, the label followed by dim values.
+static void pack_dense (vector<string> const &inputs, size_t dim, io::PackedWriter *writer) {
+    vector<float> values(dim);
+    for (string const &path: inputs) {
+        ifstream is(path.c_str());
+        if (!is) throw runtime_error("cannot open " + path);
+        string line;
+        while (getline(is, line)) {
+            istringstream ss(line);
+            int32_t label;
+            if (!(ss >> label)) continue;
+            for (size_t i = 0; i < dim; ++i) {
+                if (!(ss >> values[i])) throw runtime_error(path + ": short line: " + line);
+            }
+            writer->add(&values[0], &label);
+        }
+    }
+}
+
+int main (int argc, char *argv[]) {
+    string format;
+    vector<string> inputs;
+    string output;
+    size_t dim;
+
+    po::options_description desc_visible("General options");
+    desc_visible.add_options()
+    ("help,h", "produce help message.")
+    ("format", po::value(&format)->default_value("cifar"), "cifar, cifar100 or dense")
+    ("dim", po::value(&dim)->default_value(0), "dimension of dense input")
+    ("input", po::value(&inputs), "input files, concatenated")
+    ("output,o", po::value(&output), "")
+    ;
+
+    po::options_description desc("Allowed options");
+    desc.add(desc_visible);
+
+    po::positional_options_description p;
+    p.add("input", -1);
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).options(desc).positional(p).run(), vm);
+    po::notify(vm);
+
+    if (vm.count("help") || inputs.empty() || output.empty()) {
+        cout << "Usage: pack [--format cifar|cifar100|dense] -o <output> <input>..." << endl;
+        cout << desc_visible << endl;
+        return 0;
+    }
+
+    try {
+        if (format == "cifar" || format == "cifar100") {
+            unsigned labels = (format == "cifar") ? 1 : 2;
+            io::PackedWriter writer(output, io::PACKED_UINT8, vector<size_t>{32, 32, 3}, labels);
+            pack_cifar(inputs, labels, &writer);
+            writer.close();
+            cerr << writer.size() << " images written to " << output << endl;
+        }
+        else if (format == "dense") {
+            if (dim == 0) throw runtime_error("--dim is required for dense input");
+            io::PackedWriter writer(output, io::PACKED_FLOAT32, vector<size_t>{dim}, 1);
+            pack_dense(inputs, dim, &writer);
+            writer.close();
+            cerr << writer.size() << " examples written to " << output << endl;
+        }
+        else {
+            throw runtime_error("unknown format " + format);
+        }
+    }
+    catch (exception const &e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,64 @@
+#ifndef ARGOS_PARALLEL
+#define ARGOS_PARALLEL
+
+#include <cstddef>
+#include <algorithm>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace argos {
+    // Sizing of OpenMP loops.  Every parallel loop asks threads() for its
+    // team size with the number of elements it touches, e.g.
+    //
+    //     #pragma omp parallel for schedule(static) num_threads(parallel::threads(n))
+    //
+    // Loops touching less than grain() elements run on the calling thread,
+    // bigger ones get one thread per grain() elements up to the OpenMP
+    // maximum, so small nodes (biases, 10-class outputs) no longer wake up
+    // the whole pool.  Loops with even work use schedule(static): a thread
+    // gets the same slice of an array at every iteration, which keeps that
+    // slice in its cache (and NUMA node when OMP_PROC_BIND is set).
+    // Loops with uneven work, like sparse rows, use schedule(dynamic).
+    //
+    // The maximum is per thread: the workers of the parallel plan scheduler
+    // each limit() themselves to their share of the cores, so tasks running
+    // side by side (and the OpenMP BLAS they call) do not each start a
+    // full team.
+    namespace parallel {
+
+        // Set from "argos.global.grain" by the model.
+        inline size_t &grain () {
+            static size_t g = 16384;
+            return g;
+        }
+
+        inline int threads (size_t work) {
+#ifdef _OPENMP
+            if (omp_in_parallel()) return 1;    // no nested teams
+            size_t n = work / std::max<size_t>(grain(), 1);
+            return int(std::max<size_t>(1, std::min<size_t>(n, omp_get_max_threads())));
+#else
+            return 1;
+#endif
+        }
+
+        // Threads available to teams started from the calling thread.
+        inline int max () {
+#ifdef _OPENMP
+            return omp_get_max_threads();
+#else
+            return 1;
+#endif
+        }
+
+        // Limit teams started from the calling thread to n threads.
+        inline void limit (int n) {
+#ifdef _OPENMP
+            omp_set_num_threads(std::max(n, 1));
+#endif
+        }
+    }
+}
+
+#endif
@@ -26,8 +26,11 @@ namespace argos {
         registerClass<core::RegressionOutputNode>("regression");
         registerClass<core::MultiRegressionOutputNode>("multiregression");
         registerClass<core::WindowNode>("window");
+        registerClass<core::ConvNode>("conv-direct");
         registerClass<core::PoolNode<core::pool::max>>("max");
         registerClass<core::PoolNode<core::pool::avg>>("avg");
+        registerClass<core::Pool2DNode<core::pool2d::max>>("max2d");
+        registerClass<core::Pool2DNode<core::pool2d::avg>>("avg2d");
         registerClass<core::PadNode>("pad");
         registerClass<core::SoftMaxNode>("softmax");
         registerClass<core::NormalizeNode>("norm");
@@ -35,6 +38,7 @@ namespace argos {
         registerClass<utils::LabelTap<int>>("labeltap");
         registerClass<utils::LibSvmInputNode<int>>("input-libsvm");
         registerClass<utils::LibSvmInputNode<double>>("input-libsvr");
+        registerClass<utils::PackedInputNode>("input-packed");
         registerClass<utils::Eval>("eval");
         registerClass<utils::ArrayStat>("stat");
         registerFactory("conv", new combo::ConvNodeFactory);
@@ -50,6 +54,11 @@ namespace argos {
         registerClass<dream::RankRegression>("dream.rankregression");
         registerClass<dream::FeatureSelection>("dream.selection");
         registerClass<dream::OutputTap>("dream.tap");
+
+        registerRewrite("linear-bias", new core::fusion::LinearBias);
+        registerRewrite("normalize-linear", new core::fusion::NormalizeLinear);
+        registerRewrite("linear-activation", new core::fusion::LinearActivation);
+        registerRewrite("softmax-logp", new core::fusion::SoftMaxLogP);
     }
 }
 
@@ -0,0 +1,301 @@
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include "simd.h"
+#include "parallel.h"
+
+// Each kernel is compiled once per target below and dispatched through an
+// ifunc resolver on the CPU the program runs on.  The loops are written for
+// the vectorizer ("omp simd" lets it reorder the reductions), so the same
+// source gives 512-bit, 256-bit and SSE2 code.
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define ARGOS_KERNEL __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define ARGOS_KERNEL
+#endif
+
+#define ARGOS_INLINE inline __attribute__((always_inline))
+
+namespace argos {
+    namespace simd {
+
+        using std::vector;
+
+        // Large arrays are cut into blocks of this many elements, which are
+        // spread over the threads.  Partial sums are added up in block order,
+        // so reductions do not depend on the number of threads.
+        static constexpr size_t BLOCK = 1 << 14;
+
+        template <typename F>
+        static void blocks (size_t n, F const &f) {
+            if (n < PARALLEL_THRESHOLD) {
+                f(0, n);
+                return;
+            }
+            size_t nb = (n + BLOCK - 1) / BLOCK;
+#pragma omp parallel for schedule(static) num_threads(parallel::threads(n))
+            for (size_t b = 0; b < nb; ++b) {
+                size_t begin = b * BLOCK;
+                f(begin, std::min(n, begin + BLOCK) - begin);
+            }
+        }
+
+        template <typename F>
+        static double sum_blocks (size_t n, F const &f) {
+            if (n < PARALLEL_THRESHOLD) {
+                return f(0, n);
+            }
+            size_t nb = (n + BLOCK - 1) / BLOCK;
+            vector<double> part(nb);
+#pragma omp parallel for schedule(static) num_threads(parallel::threads(n))
+            for (size_t b = 0; b < nb; ++b) {
+                size_t begin = b * BLOCK;
+                part[b] = f(begin, std::min(n, begin + BLOCK) - begin);
+            }
+            double s = 0;
+            for (double v: part) s += v;
+            return s;
+        }
+
+        template <typename T>
+        static ARGOS_INLINE void add_body (T *y, T const *x, size_t n) {
+#pragma omp simd
+            for (size_t i = 0; i < n; ++i) y[i] += x[i];
+        }
+
+        template <typename T>
+        static ARGOS_INLINE void axpy_body (T *y, T a, T const *x, size_t n) {
+#pragma omp simd
+            for (size_t i = 0; i < n; ++i) y[i] += a * x[i];
+        }
+
+        template <typename T>
+        static ARGOS_INLINE void add_diff_body (T *y, T const *a, T const *b, size_t n) {
+#pragma omp simd
+            for (size_t i = 0; i < n; ++i) y[i] += a[i] - b[i];
+        }
+
+        template <typename T>
+        static ARGOS_INLINE void scale_body (T *y, T a, size_t n) {
+#pragma omp simd
+            for (size_t i = 0; i < n; ++i) y[i] *= a;
+        }
+
+        template <typename T>
+        static ARGOS_INLINE double sumsq_body (T const *x, size_t n) {
+            double s = 0;
+#pragma omp simd reduction(+:s)
+            for (size_t i = 0; i < n; ++i) s += double(x[i]) * x[i];
+            return s;
+        }
+
+        template <typename T>
+        static ARGOS_INLINE double l2sqr_body (T const *x, T const *y, size_t n) {
+            double s = 0;
+#pragma omp simd reduction(+:s)
+            for (size_t i = 0; i < n; ++i) {
+                double v = double(x[i]) - y[i];
+                s += v * v;
+            }
+            return s;
+        }
+
+        template <typename T>
+        static ARGOS_INLINE double dot_body (T const *x, T const *y, size_t n) {
+            double s = 0;
+#pragma omp simd reduction(+:s)
+            for (size_t i = 0; i < n; ++i) s += double(x[i]) * y[i];
+            return s;
+        }
+
+        // n is the length of the whole row, the block being part of it
+        template <typename T>
+        static ARGOS_INLINE void norm_delta_body (T *y, T const *d, T const *x, T r, T n, size_t m) {
+#pragma omp simd
+            for (size_t i = 0; i < m; ++i) {
+                T o = x[i] * r;
+                y[i] = d[i] * r * (T(1) - o * o / n);
+            }
+        }
+
+        // exp(-y) for y >= 0 in a form the vectorizer takes: y = k ln2 - r
+        // with |r| <= ln2/2 (ln2 split in two for precision), exp(r) by its
+        // Taylor series to below an ulp, and 2^-k built in the exponent bits.
+        // y is clamped to where 2^-k is normal; exp is < 1e-37 (float) or
+        // 1e-307 (double) there, which does not matter to a softmax.  The
+        // clamp compares the bits of y, which order like the values as y is
+        // not negative: float compares are not if-converted under trapping
+        // math (main.cpp enables FE_INVALID and FE_OVERFLOW traps), and
+        // hoisting the conversion above the clamp would trap.
+        template <typename T>
+        struct ExpConst;
+
+        template <>
+        struct ExpConst<float> {
+            typedef int32_t bits_type;
+            static constexpr int MANTISSA = 23;
+            static constexpr int BIAS = 127;
+            static constexpr float MAX = 87.0f;
+            static constexpr float LN2_HI = 0.693359375f;
+            static constexpr float LN2_LO = -2.12194440e-4f;
+            static constexpr unsigned ORDER = 7;
+        };
+
+        template <>
+        struct ExpConst<double> {
+            typedef int64_t bits_type;
+            static constexpr int MANTISSA = 52;
+            static constexpr int BIAS = 1023;
+            static constexpr double MAX = 708.0;
+            static constexpr double LN2_HI = 6.93145751953125e-1;
+            static constexpr double LN2_LO = 1.42860682030941723212e-6;
+            static constexpr unsigned ORDER = 13;
+        };
+
+        // 1 + r/K (1 + r/(K+1) (... (1 + r/N))), the Taylor series of exp
+        // from the K-th term on, unrolled at compile time.
+        template <typename T, unsigned K, unsigned N>
+        struct Taylor {
+            static ARGOS_INLINE T eval (T r) {
+                return 1 + r * T(1.0 / K) * Taylor<T, K + 1, N>::eval(r);
+            }
+        };
+
+        template <typename T, unsigned N>
+        struct Taylor<T, N, N> {
+            static ARGOS_INLINE T eval (T r) {
+                return 1 + r * T(1.0 / N);
+            }
+        };
+
+        template <typename T>
+        static ARGOS_INLINE T exp_neg (T y) {
+            typedef ExpConst<T> C;
+            typedef typename C::bits_type bits_type;
+            union Bits {
+                T v;
+                bits_type b;
+            } u, max, scale;
+            u.v = y;
+            max.v = C::MAX;
+            u.b = u.b < max.b ? u.b : max.b;
+            y = u.v;
+            int32_t k = int32_t(y * T(1.4426950408889634) + T(0.5));
+            T r = (T(k) * C::LN2_HI - y) + T(k) * C::LN2_LO;
+            scale.b = bits_type(C::BIAS - k) << C::MANTISSA;
+            return Taylor<T, 1, C::ORDER>::eval(r) * scale.v;
+        }
+
+        template <typename T>
+        static ARGOS_INLINE void softmax_body (T const *x, T *y, size_t n) {
+            T m = x[0];
+#pragma omp simd reduction(max:m)
+            for (size_t i = 0; i < n; ++i) m = x[i] > m ? x[i] : m;
+            T sum = 0;
+#pragma omp simd reduction(+:sum)
+            for (size_t i = 0; i < n; ++i) {
+                T e = exp_neg(m - x[i]);
+                y[i] = e;
+                sum += e;
+            }
+            T inv = T(1) / sum;
+#pragma omp simd
+            for (size_t i = 0; i < n; ++i) y[i] *= inv;
+        }
+
+        // Per-target kernels.  Outputs may be identical to an input
+        // (e.g. x.add(x)) but must not overlap it otherwise.
+        ARGOS_KERNEL static void add_f (float *y, float const *x, size_t n) { add_body(y, x, n); }
+        ARGOS_KERNEL static void add_d (double *y, double const *x, size_t n) { add_body(y, x, n); }
+        ARGOS_KERNEL static void axpy_f (float *y, float a, float const *x, size_t n) { axpy_body(y, a, x, n); }
+        ARGOS_KERNEL static void axpy_d (double *y, double a, double const *x, size_t n) { axpy_body(y, a, x, n); }
+        ARGOS_KERNEL static void add_diff_f (float *y, float const *a, float const *b, size_t n) { add_diff_body(y, a, b, n); }
+        ARGOS_KERNEL static void add_diff_d (double *y, double const *a, double const *b, size_t n) { add_diff_body(y, a, b, n); }
+        ARGOS_KERNEL static void scale_f (float *y, float a, size_t n) { scale_body(y, a, n); }
+        ARGOS_KERNEL static void scale_d (double *y, double a, size_t n) { scale_body(y, a, n); }
+        ARGOS_KERNEL static double sumsq_f (float const *x, size_t n) { return sumsq_body(x, n); }
+        ARGOS_KERNEL static double sumsq_d (double const *x, size_t n) { return sumsq_body(x, n); }
+        ARGOS_KERNEL static double l2sqr_f (float const *x, float const *y, size_t n) { return l2sqr_body(x, y, n); }
+        ARGOS_KERNEL static double l2sqr_d (double const *x, double const *y, size_t n) { return l2sqr_body(x, y, n); }
+        ARGOS_KERNEL static double dot_f (float const *x, float const *y, size_t n) { return dot_body(x, y, n); }
+        ARGOS_KERNEL static double dot_d (double const *x, double const *y, size_t n) { return dot_body(x, y, n); }
+        ARGOS_KERNEL static void norm_delta_f (float *y, float const *d, float const *x, float r, float n, size_t m) { norm_delta_body(y, d, x, r, n, m); }
+        ARGOS_KERNEL static void norm_delta_d (double *y, double const *d, double const *x, double r, double n, size_t m) { norm_delta_body(y, d, x, r, n, m); }
+        ARGOS_KERNEL static void softmax_f (float const *x, float *y, size_t n) { softmax_body(x, y, n); }
+        ARGOS_KERNEL static void softmax_d (double const *x, double *y, size_t n) { softmax_body(x, y, n); }
+
+        void add (float *y, float const *x, size_t n) {
+            blocks(n, [=](size_t b, size_t m) { add_f(y + b, x + b, m); });
+        }
+
+        void add (double *y, double const *x, size_t n) {
+            blocks(n, [=](size_t b, size_t m) { add_d(y + b, x + b, m); });
+        }
+
+        void axpy (float *y, float a, float const *x, size_t n) {
+            blocks(n, [=](size_t b, size_t m) { axpy_f(y + b, a, x + b, m); });
+        }
+
+        void axpy (double *y, double a, double const *x, size_t n) {
+            blocks(n, [=](size_t b, size_t m) { axpy_d(y + b, a, x + b, m); });
+        }
+
+        void add_diff (float *y, float const *a, float const *b, size_t n) {
+            blocks(n, [=](size_t o, size_t m) { add_diff_f(y + o, a + o, b + o, m); });
+        }
+
+        void add_diff (double *y, double const *a, double const *b, size_t n) {
+            blocks(n, [=](size_t o, size_t m) { add_diff_d(y + o, a + o, b + o, m); });
+        }
+
+        void scale (float *y, float a, size_t n) {
+            blocks(n, [=](size_t b, size_t m) { scale_f(y + b, a, m); });
+        }
+
+        void scale (double *y, double a, size_t n) {
+            blocks(n, [=](size_t b, size_t m) { scale_d(y + b, a, m); });
+        }
+
+        double sumsq (float const *x, size_t n) {
+            return sum_blocks(n, [=](size_t b, size_t m) { return sumsq_f(x + b, m); });
+        }
+
+        double sumsq (double const *x, size_t n) {
+            return sum_blocks(n, [=](size_t b, size_t m) { return sumsq_d(x + b, m); });
+        }
+
+        double l2sqr (float const *x, float const *y, size_t n) {
+            return sum_blocks(n, [=](size_t b, size_t m) { return l2sqr_f(x + b, y + b, m); });
+        }
+
+        double l2sqr (double const *x, double const *y, size_t n) {
+            return sum_blocks(n, [=](size_t b, size_t m) { return l2sqr_d(x + b, y + b, m); });
+        }
+
+        double dot (float const *x, float const *y, size_t n) {
+            return sum_blocks(n, [=](size_t b, size_t m) { return dot_f(x + b, y + b, m); });
+        }
+
+        double dot (double const *x, double const *y, size_t n) {
+            return sum_blocks(n, [=](size_t b, size_t m) { return dot_d(x + b, y + b, m); });
+        }
+
+        void norm_delta (float *y, float const *d, float const *x, float r, size_t n) {
+            blocks(n, [=](size_t b, size_t m) { norm_delta_f(y + b, d + b, x + b, r, float(n), m); });
+        }
+
+        void norm_delta (double *y, double const *d, double const *x, double r, size_t n) {
+            blocks(n, [=](size_t b, size_t m) { norm_delta_d(y + b, d + b, x + b, r, double(n), m); });
+        }
+
+        // a softmax row is short, callers parallelize over rows
+        void softmax (float const *x, float *y, size_t n) {
+            softmax_f(x, y, n);
+        }
+
+        void softmax (double const *x, double *y, size_t n) {
+            softmax_d(x, y, n);
+        }
+    }
+}
@@ -0,0 +1,105 @@
+#ifndef ARGOS_SIMD
+#define ARGOS_SIMD
+
+#include <cstddef>
+#include <cmath>
+#include <algorithm>
+
+namespace argos {
+    // Elementwise kernels behind Array arithmetics.  The float and double
+    // versions are built for AVX-512, AVX2 and plain x86-64, the best one
+    // being picked at load time, and run multithreaded on large arrays.
+    // Other element types use the scalar templates below.
+    namespace simd {
+        // Arrays shorter than this are processed in one piece, longer ones
+        // in blocks spread over parallel::threads().
+        static constexpr size_t PARALLEL_THRESHOLD = 1 << 16;
+
+        void add (float *y, float const *x, size_t n);         // y += x
+        void add (double *y, double const *x, size_t n);
+        void axpy (float *y, float a, float const *x, size_t n);    // y += a * x
+        void axpy (double *y, double a, double const *x, size_t n);
+        void add_diff (float *y, float const *a, float const *b, size_t n);   // y += a - b
+        void add_diff (double *y, double const *a, double const *b, size_t n);
+        void scale (float *y, float a, size_t n);      // y *= a
+        void scale (double *y, double a, size_t n);
+        double sumsq (float const *x, size_t n);       // sum x^2
+        double sumsq (double const *x, size_t n);
+        double l2sqr (float const *x, float const *y, size_t n);   // sum (x-y)^2
+        double l2sqr (double const *x, double const *y, size_t n);
+        double dot (float const *x, float const *y, size_t n);     // sum x*y
+        double dot (double const *x, double const *y, size_t n);
+        // y = d r (1 - (r x)^2 / n): input delta of a row normalized to
+        // r x, r = 1 / sqrt(sum x^2 / n), given its output delta d
+        void norm_delta (float *y, float const *d, float const *x, float r, size_t n);
+        void norm_delta (double *y, double const *d, double const *x, double r, size_t n);
+        // y = softmax(x) of one row, with the row max subtracted before exp
+        void softmax (float const *x, float *y, size_t n);
+        void softmax (double const *x, double *y, size_t n);
+
+        template <typename T>
+        void add (T *y, T const *x, size_t n) {
+            for (size_t i = 0; i < n; ++i) y[i] += x[i];
+        }
+
+        template <typename T>
+        void axpy (T *y, T a, T const *x, size_t n) {
+            for (size_t i = 0; i < n; ++i) y[i] += a * x[i];
+        }
+
+        template <typename T>
+        void add_diff (T *y, T const *a, T const *b, size_t n) {
+            for (size_t i = 0; i < n; ++i) y[i] += a[i] - b[i];
+        }
+
+        template <typename T>
+        void scale (T *y, T a, size_t n) {
+            for (size_t i = 0; i < n; ++i) y[i] *= a;
+        }
+
+        template <typename T>
+        double sumsq (T const *x, size_t n) {
+            double s = 0;
+            for (size_t i = 0; i < n; ++i) s += double(x[i]) * x[i];
+            return s;
+        }
+
+        template <typename T>
+        double l2sqr (T const *x, T const *y, size_t n) {
+            double s = 0;
+            for (size_t i = 0; i < n; ++i) {
+                double v = double(x[i]) - y[i];
+                s += v * v;
+            }
+            return s;
+        }
+
+        template <typename T>
+        double dot (T const *x, T const *y, size_t n) {
+            double s = 0;
+            for (size_t i = 0; i < n; ++i) s += double(x[i]) * y[i];
+            return s;
+        }
+
+        template <typename T>
+        void norm_delta (T *y, T const *d, T const *x, T r, size_t n) {
+            for (size_t i = 0; i < n; ++i) {
+                T o = x[i] * r;
+                y[i] = d[i] * r * (T(1) - o * o / T(n));
+            }
+        }
+
+        template <typename T>
+        void softmax (T const *x, T *y, size_t n) {
+            T m = *std::max_element(x, x + n);
+            T sum = 0;
+            for (size_t i = 0; i < n; ++i) {
+                y[i] = std::exp(x[i] - m);
+                sum += y[i];
+            }
+            for (size_t i = 0; i < n; ++i) y[i] /= sum;
+        }
+    }
+}
+
+#endif